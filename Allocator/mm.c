@@ -4,10 +4,75 @@
  * mm.c - The memory-efficient malloc package.
  * 
  * In my approach, a block has a header to store the size of the block, as well as 
- * an "allocated" bit, and also uses a footer to store the size of the block. Also,
- * it uses a prolog block and a terminator block. In order to implement a quick and
- * efficient memory allocation, I chose to perform coalescing, use first-fit placement
- * and exlicit free list, and unmap unused pages.
+ * an "allocated" bit, and a free block also uses a footer to store the size of the
+ * block. An allocated block has no footer: the header of every block records
+ * whether the block before it is allocated, and only a free block before it is ever
+ * found through its footer. Also, it uses a prolog block and a terminator block. In
+ * order to implement a quick and efficient memory allocation, I chose to perform
+ * coalescing, use good-fit placement over segregated explicit free lists, and unmap
+ * unused pages.
+ *
+ * Free blocks are kept in NUM_LISTS doubly linked lists, one per size class. A size
+ * class covers a quarter of a power of two, so a block in any larger class always
+ * fits the request, and a bitmap of the non-empty lists lets us jump straight to it.
+ * Blocks of LARGE_BLOCK_SIZE bytes and more are kept in a splay tree instead, ordered
+ * by size and then address, so the best fit for a large request is found in
+ * O(log n). The tree nodes live in the payload of the free blocks, like the list nodes.
+ *
+ * Small requests, up to SLAB_MAX_SIZE bytes, never reach the free lists. They are
+ * served from slabs: chunks from mem_map cut into equal slots of one size class,
+ * with no header or footer per slot. A freed slot goes on an intrusive list in its
+ * slab, and a page map from address to slab tells mm_free which slab owns a pointer.
+ *
+ * Built with MM_THREAD_SAFE, the free lists are shared by all threads behind one
+ * lock, and each thread keeps a cache of freed blocks up to TCACHE_MAX_SIZE bytes.
+ * Most requests are served from the cache without the lock; the cache is refilled
+ * and flushed TCACHE_BATCH blocks at a time, so the lock is taken once per batch.
+ * Slabs are owned by the thread_heap of the thread that mapped them, and only the
+ * owner touches them. A slot freed by another thread is pushed on the owner's
+ * remote_frees stack with a compare-and-swap, and the owner takes the whole stack
+ * back on its next mm_malloc. When a thread exits, its thread_heap is kept with its
+ * slabs, guarded by the lock, until a new thread adopts it.
+ *
+ * mm_realloc resizes a block in place when it can: it shrinks by splitting off the
+ * tail, and grows by absorbing the free block after it. Only when the next block is
+ * allocated or too small does it allocate, copy and free.
+ *
+ * mm_memalign finds a free block with room to spare and splits off the space before
+ * the aligned payload as a free block of its own. mm_malloc_batch cuts many blocks
+ * of one size out of a single free block, and mm_free_batch frees a run of blocks
+ * under one lock.
+ *
+ * Built with MM_DEFER_COALESCE, a freed block of up to QUICK_MAX_SIZE bytes is not
+ * coalesced right away. It stays marked allocated and is parked in a quick bin of
+ * its exact size, where the next request of that size takes it back without any
+ * splitting. Parked blocks are coalesced all at once when the free lists miss or
+ * when more than QUICK_LIMIT blocks are parked.
+ *
+ * Requests of HUGE_SIZE bytes and more get a mapping of their own, marked by
+ * HUGE_BIT in the header, with no prolog or terminator. Pages that become empty and
+ * huge mappings that are freed are not unmapped right away. They are kept in a small
+ * cache of recent mappings, and map_pages reuses one of those before calling mem_map.
+ *
+ * Once the pages of blocks add up to THP_HEAP_SIZE, the heap grows in multiples of
+ * THP_SIZE, aligned to THP_SIZE and advised as candidates for transparent huge pages.
+ * A free block of at least PURGE_MIN_SIZE bytes gives the pages inside it back to the
+ * kernel with madvise, keeping only the pages with its header, links and footer, so
+ * memory is returned before a whole page of blocks is empty.
+ *
+ * An arena hands out memory by bumping a pointer through chunks from map_pages, and
+ * everything in it is freed at once by mm_arena_reset or mm_arena_destroy. Memory
+ * from an arena must never be passed to mm_free or mm_realloc.
+ *
+ * Built with MM_STATS, the allocator counts what it does. Counters touched on the
+ * fast paths live in each thread_heap and are summed by mm_get_stats, the others
+ * are only touched under the lock. Every page of blocks starts with links to the
+ * other pages, so mm_heap_walk can walk all blocks from prolog to terminator and
+ * report how fragmented the free space is.
+ *
+ * Built with MM_TRACE, every call to mm_init, mm_malloc, mm_free, mm_realloc and
+ * mm_memalign is written to the file named by MM_TRACE_FILE, or mm.trace, in the
+ * format described in mm_ext.h. mm_replay runs such a trace against this allocator.
  *
  */
 #include <stdio.h>
@@ -15,15 +80,23 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#ifdef MM_THREAD_SAFE
+#include <pthread.h>
+#endif
+#ifdef MM_TRACE
+#include <fcntl.h>
+#endif
+#include <sys/mman.h>
 
 #include "mm.h"
+#include "mm_ext.h"
 #include "memlib.h"
 
 /* always use 16-byte alignment */
 #define ALIGNMENT 16
 
-/* the overhead of page is always 32 with prolog block and terminator */
-#define PAGE_OVERHEAD 32
+/* the overhead of page is always 48 with page links, prolog block and terminator */
+#define PAGE_OVERHEAD 48
 
 /* the allocation granularity is a power of 2 and at least 4096 */
 #define ALLOC_GRANULARITY 4096
@@ -42,21 +115,175 @@
 #define FTRP(bp) ((char*)(bp) + GET_SIZE(HDRP(bp)) - OVERHEAD)
 
 // Given a payload pointer, get the next or previous payload pointer
+// The previous block can only be found when it is free, since only free blocks have footers
 #define NEXT_BLKP(bp) ((char*)(bp) + GET_SIZE(HDRP(bp)))
 #define PREV_BLKP(bp) ((char*)(bp) - GET_SIZE((char*)(bp)-OVERHEAD))
 
+// The size of the block for a payload, an allocated block only has a header
+#define BLOCK_SIZE(size) (ALIGN((size) + sizeof(block_header)) < MIN_BLOCK_SIZE ? \
+                          MIN_BLOCK_SIZE : ALIGN((size) + sizeof(block_header)))
+
 // ******These macros assume you are using a size_t for headers and footers ******
 // Given a pointer to a header, get or set its value
+// Threads read the headers of their own blocks without the lock, while the lock holder
+// may flip the previous allocated bit in them, so the words are accessed atomically
+#ifdef MM_THREAD_SAFE
+#define GET(p) __atomic_load_n((size_t *)(p), __ATOMIC_RELAXED)
+#define PUT(p, val) __atomic_store_n((size_t *)(p), (val), __ATOMIC_RELAXED)
+#else
 #define GET(p) (*(size_t *)(p))
 #define PUT(p, val) (*(size_t *)(p) = (val))
+#endif
 
 // Combine a size and alloc bit
 #define PACK(size, alloc) ((size) | (alloc))
 
+// Marks the header of a block with its own mapping
+#define HUGE_BIT 0x2
+
+// Marks the header of a block whose previous block is allocated
+#define PREV_ALLOC_BIT 0x4
+
+// Marks the header of the first block of a page, right after the prolog
+#define PAGE_START_BIT 0x8
+
 // Given a header pionter, get the alloc or size
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_HUGE(p)  (GET(p) & HUGE_BIT)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC_BIT)
+#define GET_PAGE_START(p) (GET(p) & PAGE_START_BIT)
 #define GET_SIZE(p)  (GET(p) & ~0xF)
 
+// Given a header pointer, get the bits about the block's place rather than the block
+#define GET_PLACE_BITS(p) (GET(p) & (PREV_ALLOC_BIT | PAGE_START_BIT))
+
+// Given a payload pointer, tell if the block is all of its page, from prolog to terminator
+#define WHOLE_PAGE(bp) (GET_PAGE_START(HDRP(bp)) && GET_SIZE(FTRP(bp) + 8) == 0)
+
+// Given a header pointer, set or clear its previous allocated bit
+#define SET_PREV_ALLOC(p) PUT(p, GET(p) | PREV_ALLOC_BIT)
+#define CLEAR_PREV_ALLOC(p) PUT(p, GET(p) & ~PREV_ALLOC_BIT)
+
+// the smallest block is 32 bytes, the size of class 0
+#define MIN_BLOCK_LOG 5
+#define MIN_BLOCK_SIZE (1 << MIN_BLOCK_LOG)
+
+// free blocks of at least this size go in the tree instead of the lists
+#define LARGE_BLOCK_LOG 12
+#define LARGE_BLOCK_SIZE (1 << LARGE_BLOCK_LOG)
+
+// number of segregated free lists, four size classes per power of two
+#define NUM_LISTS ((LARGE_BLOCK_LOG - MIN_BLOCK_LOG) << 2)
+
+// how many blocks of the request's own class we look at for a good fit
+#define GOOD_FIT_SCAN 8
+
+// requests up to this size are served from slabs, one slab class per ALIGNMENT
+#define SLAB_MAX_SIZE 128
+#define SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+
+// the size of each slab, mapped in one piece
+#define SLAB_SIZE PAGE_ALIGN(4 * ALLOC_GRANULARITY)
+
+// requests of at least this size get a mapping of their own
+#define HUGE_SIZE (64 * ALLOC_GRANULARITY)
+
+// the header of a huge block sits ALIGNMENT bytes into its mapping
+#define HUGE_OVERHEAD ALIGNMENT
+
+// the cache of emptied mappings holds at most this many, and this many bytes
+#define PAGE_CACHE_SLOTS 8
+#define PAGE_CACHE_BYTES (4096 * ALLOC_GRANULARITY)
+
+// large heaps grow in pieces of this size, aligned for transparent huge pages
+#define THP_SIZE (512 * ALLOC_GRANULARITY)
+#define THP_HEAP_SIZE (4 * THP_SIZE)
+
+// free blocks of at least this size give their inner pages back to the kernel
+#define PURGE_MIN_SIZE HUGE_SIZE
+
+// how pages are given back, MADV_FREE only drops them when memory runs low
+#if defined(MM_LAZY_PURGE) && defined(MADV_FREE)
+#define PURGE_ADVICE MADV_FREE
+#else
+#define PURGE_ADVICE MADV_DONTNEED
+#endif
+
+// the first chunk of an arena, later chunks double up to ARENA_MAX_CHUNK
+#define ARENA_CHUNK (16 * ALLOC_GRANULARITY)
+#define ARENA_MAX_CHUNK (256 * ALLOC_GRANULARITY)
+
+// the page map has three levels of 4096 entries over ALLOC_GRANULARITY pages
+#define GRANULE_SHIFT 12
+#define PAGEMAP_BITS 12
+#define PAGEMAP_ENTRIES (1 << PAGEMAP_BITS)
+#define PAGEMAP_MASK (PAGEMAP_ENTRIES - 1)
+
+// blocks from SLAB_MAX_SIZE up to this size are cached per thread, one bin per ALIGNMENT
+#define TCACHE_MAX_SIZE 1024
+#define TCACHE_BINS ((TCACHE_MAX_SIZE - SLAB_MAX_SIZE) / ALIGNMENT)
+
+// objects moved between a thread cache and the heap under one lock
+#define TCACHE_BATCH 16
+
+// a bin holding this many objects flushes a batch back to the heap
+#define TCACHE_LIMIT (4 * TCACHE_BATCH)
+
+// freed blocks up to this size are parked when built with MM_DEFER_COALESCE,
+// one quick bin per ALIGNMENT
+#define QUICK_MAX_SIZE 2048
+#define QUICK_BINS (QUICK_MAX_SIZE / ALIGNMENT + 1)
+
+// parking more blocks than this coalesces all of them
+#define QUICK_LIMIT 256
+
+// the lock around the shared heap, only taken when built thread safe
+#ifdef MM_THREAD_SAFE
+#define LOCK_HEAP() pthread_mutex_lock(&heap_lock)
+#define UNLOCK_HEAP() pthread_mutex_unlock(&heap_lock)
+#else
+#define LOCK_HEAP()
+#define UNLOCK_HEAP()
+#endif
+
+// count an event, only when built with MM_STATS
+#ifdef MM_STATS
+#define STAT_ADD(heap, field, n) \
+  __atomic_store_n(&(*(heap)).stats.field, (*(heap)).stats.field + (n), __ATOMIC_RELAXED)
+#define CENTRAL_STAT_ADD(field, n) (central_stats.field += (n))
+#else
+#define STAT_ADD(heap, field, n)
+#define CENTRAL_STAT_ADD(field, n)
+#endif
+
+// record a call in the trace, only when built with MM_TRACE
+#ifdef MM_TRACE
+#define TRACE_INIT() trace_init()
+#define TRACE_MALLOC(p, size) trace_malloc(p, size)
+#define TRACE_FREE(p) trace_free(p)
+#define TRACE_REALLOC(p, size, new_p) trace_realloc(p, size, new_p)
+#define TRACE_MEMALIGN(p, alignment, size) trace_memalign(p, alignment, size)
+#else
+#define TRACE_INIT()
+#define TRACE_MALLOC(p, size)
+#define TRACE_FREE(p)
+#define TRACE_REALLOC(p, size, new_p)
+#define TRACE_MEMALIGN(p, alignment, size)
+#endif
+
+// the trace is written out in pieces of this size
+#define TRACE_BUFFER_SIZE 65536
+
+// the longest record, a kind byte and three varints
+#define TRACE_MAX_RECORD 31
+
+// the heap of the calling thread, there is only one without threads
+#ifdef MM_THREAD_SAFE
+#define MY_HEAP() (thread_heap_ptr != NULL ? thread_heap_ptr : attach_thread_heap())
+#else
+#define MY_HEAP() (&main_heap)
+#endif
+
 // Header and footer for block
 typedef size_t block_header;
 typedef size_t block_footer;
@@ -68,21 +295,218 @@ typedef struct node
   struct node* next;
 }node;
 
-struct node* list_header;
+/* links at the start of every page of blocks, before the prolog */
+typedef struct page_link
+{
+  struct page_link* pre;
+  struct page_link* next;
+}page_link;
+
+/* counters a thread keeps without the lock, summed by mm_get_stats */
+typedef struct thread_stats
+{
+  size_t mallocs;
+  size_t frees;
+  size_t bytes_in_use;//wraps below zero when freeing what others allocated
+}thread_stats;
+
+/* node for the tree of large free blocks */
+typedef struct tree_node
+{
+  struct tree_node* left;
+  struct tree_node* right;
+}tree_node;
+
+/* header at the start of each chunk of an arena */
+typedef struct arena_chunk
+{
+  struct arena_chunk* next;
+  size_t size;//the whole mapping
+}arena_chunk;
+
+/* an arena, kept in its first chunk right after the chunk header */
+struct mm_arena
+{
+  struct arena_chunk* chunks;//newest first, so the first chunk is last
+  char* bump;//the next free byte of the newest chunk
+  char* end;
+  size_t next_chunk;//the size of the next chunk to map
+};
+
+/* header at the start of a slab, followed by its slots */
+typedef struct slab
+{
+  struct slab* pre;
+  struct slab* next;
+  struct thread_heap* owner;//the only heap that touches free_slots
+  void* free_slots;//freed slots, linked through their first word
+  char* bump;//the next slot that was never handed out
+  char* end;
+  size_t slot_size;
+  size_t used;
+}slab;
+
+/* the slabs of one thread, or of the whole program without threads */
+typedef struct thread_heap
+{
+  struct slab* slab_lists[SLAB_CLASSES];//slabs with at least one free slot
+  void* remote_frees;//slots freed by other threads, linked through their first word
+  int alive;//0 once the thread exited, then the lock guards the heap
+  struct thread_heap* next;//all heaps ever made, for adoption and stats
+  thread_stats stats;
+}thread_heap;
+
+struct node* free_lists[NUM_LISTS];
+size_t list_bitmap;//bit i is set when free_lists[i] is not empty
+struct tree_node* large_tree;//root of the tree of large free blocks
 size_t initial_page;
+size_t page_bytes;//the size of all pages of blocks
+struct page_link* all_pages;//every page of blocks, for mm_heap_walk
+mm_stats central_stats;//the counters only touched under the lock
+
+void* cached_pages[PAGE_CACHE_SLOTS];//emptied mappings, oldest first
+size_t cached_sizes[PAGE_CACHE_SLOTS];
+int cached_count;
+size_t cached_bytes;
+
+void** pagemap[PAGEMAP_ENTRIES];//root of the page map from address to slab
+
+#ifdef MM_DEFER_COALESCE
+static void* quick_bins[QUICK_BINS];//parked blocks by size, linked through their first word
+static int quick_count;
+#endif
+
+#ifdef MM_THREAD_SAFE
+/* objects a thread freed and keeps for its next requests */
+typedef struct tcache
+{
+  void* bins[TCACHE_BINS];//linked through their first word
+  int counts[TCACHE_BINS];
+}tcache;
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;//flushes the cache when a thread exits
+static __thread tcache thread_cache;
+static __thread thread_heap* thread_heap_ptr;
+static thread_heap* all_heaps;
+static char* heap_records;//unused space for thread_heap records
+static char* heap_records_end;
+#else
+static thread_heap main_heap;
+#endif
+
+#ifdef MM_TRACE
+static int trace_fd = -1;
+static unsigned char trace_buffer[TRACE_BUFFER_SIZE];
+static size_t trace_used;
+static size_t trace_last;//the address of the last record, divided by ALIGNMENT
+#ifdef MM_THREAD_SAFE
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#endif
 
 // ******helper functions******
+// Allocate without tracing the call
+static void* allocate(size_t size);
+
+// Free without tracing the call
+static void release(void* ptr);
+
+// Resize without tracing the call
+static void* reallocate(void* ptr, size_t size);
+
+// Allocate a block from the free lists, the caller holds the heap lock
+static void* central_malloc(size_t size);
+
+// Free a block to the free lists, the caller holds the heap lock
+static void central_free(void* ptr);
+
+// Mark a block free, coalesce it and unmap its page if it is empty
+static void free_block(void* ptr);
+
+// Coalesce a block just marked free and give back the pages inside it if it is large
+static void* coalesce_and_purge(void* ptr);
+
+// Resize an allocated block without moving it, returns 0 if it cannot
+static int resize_in_place(void* bp, size_t size);
+
+// Allocate a block with an aligned payload, the caller holds the heap lock
+static void* central_memalign(size_t alignment, size_t size);
+
+// Allocate up to count blocks of one size, the caller holds the heap lock
+static size_t central_malloc_batch(size_t size, size_t count, void** ptrs);
+
+// Cut an allocated block into up to count blocks of size bytes
+static size_t carve_blocks(void* bp, size_t size, size_t count, void** ptrs);
+
+// Allocate a block with a mapping of its own
+static void* huge_malloc(size_t size);
+
+// Map a new chunk of at least size bytes for an arena
+static int arena_grow(mm_arena* arena, size_t size);
+
+// Get pages from the cache of emptied mappings or from mem_map
+static void* map_pages(size_t size, size_t* mapped);
+
+// Get pages aligned to THP_SIZE, from the cache or from mem_map
+static void* map_aligned_pages(size_t size, size_t* mapped);
+
+// Take a mapping out of the cache of emptied mappings
+static void* take_cached(int i, size_t* mapped);
+
+// Give the pages strictly inside start to end back to the kernel
+static void purge_pages(char* start, char* end);
+
+// Keep emptied pages in the cache, unmapping the oldest ones if it is full
+static void unmap_pages(void* p, size_t size);
+
+// Call mem_map, counting the mapping
+static void* heap_map(size_t size);
+
+// Call mem_unmap, counting the mapping
+static void heap_unmap(void* p, size_t size);
+
+#ifdef MM_STATS
+// Get the size of a block or slot handed out
+static size_t object_size(void* p);
+#endif
+
+#ifdef MM_TRACE
+// Open the trace on the first mm_init and record the call
+static void trace_init(void);
+
+// Record calls in the trace
+static void trace_malloc(void* p, size_t size);
+static void trace_free(void* p);
+static void trace_realloc(void* p, size_t size, void* new_p);
+static void trace_memalign(void* p, size_t alignment, size_t size);
+
+// Append a varint, or an address relative to the last one, to the trace
+static void trace_put_size(size_t size);
+static void trace_put_address(void* p);
+
+// Write out what the trace buffer holds
+static void trace_flush(void);
+#endif
+
 // Set a block to allocated
 static void set_allocated(void* b, size_t size);
 
 // Request more memory by calling mem_map 
-static void extend(size_t s);
+static void* extend(size_t s);
 
 // Coalesce a free block if applicable
 static void* coalesce(void* bp);
 
-// Find the next free block by using first fit method
-static void* first_fit(size_t s);
+// Find a free block, coalescing parked blocks if nothing fits
+static void* find_fit(size_t s);
+
+// Find a free block by using good fit over the segregated lists
+static void* good_fit(size_t s);
+
+// Get the index of the free list for a block size
+static int list_index(size_t size);
 
 // Add node to the free list
 static void add_list_node(void* bp);
@@ -90,13 +514,100 @@ static void add_list_node(void* bp);
 // Remove node from the  free list
 static void remove_list_node(void* bp);
 
+// Splay the node closest to a size and address to the root of a tree
+static tree_node* splay(tree_node* t, size_t size, void* bp);
+
+// Add a large free block to the tree
+static void tree_insert(void* bp);
+
+// Remove a large free block from the tree
+static void tree_remove(void* bp);
+
+// Find the smallest large free block of at least s bytes
+static void* tree_best_fit(size_t s);
+
+// Allocate a slot from the heap's slab class of size
+static void* slab_malloc(thread_heap* heap, size_t size);
+
+// Free a slot, by its owner or through the owner's remote frees
+static void slot_free(thread_heap* heap, slab* sb, void* p);
+
+// Return a slot to its slab, returns the slab if it should be unmapped
+static slab* slab_free(slab* sb, void* p);
+
+// Map a new slab for a slab class of a heap
+static slab* new_slab(thread_heap* heap, int slab_class);
+
+// Unmap an empty slab
+static void release_slab(slab* sb);
+
+#ifdef MM_DEFER_COALESCE
+// Free and coalesce every parked block
+static void quick_flush(void);
+#endif
+
+// Find the slab that p belongs to, or NULL
+static slab* pagemap_get(void* p);
+
+// Record sb as the slab of every page from p to p + size
+static int pagemap_set(void* p, size_t size, slab* sb);
+
+#ifdef MM_THREAD_SAFE
+// Allocate from the thread cache, refilling it from the heap if needed
+static void* tcache_malloc(size_t size);
+
+// Keep a freed object in the thread cache, returns 0 if it is too big
+static int tcache_free(void* ptr);
+
+// Give a batch of objects of a bin back to the heap
+static void tcache_flush(tcache* cache, int bin, int count);
+
+// Create the key whose destructor flushes a thread's cache
+static void tcache_make_key(void);
+
+// Flush the whole cache of an exiting thread and give up its heap
+static void tcache_destroy(void* cache);
+
+// Give the calling thread a heap, adopting one of an exited thread if possible
+static thread_heap* attach_thread_heap(void);
+
+// Push a slot on the remote frees of its owner
+static void push_remote_free(thread_heap* owner, void* p);
+
+// Take back the slots other threads freed to a heap
+static void drain_remote_frees(thread_heap* heap);
+#endif
+
 
 /* 
  * mm_init - initialize the malloc package.
  */
 int mm_init(void)
 {
-  list_header = NULL;//initialize the free list
+  memset(free_lists, 0, sizeof(free_lists));//initialize the free lists
+  list_bitmap = 0;
+  large_tree = NULL;
+  initial_page = 0;
+  page_bytes = 0;
+  all_pages = NULL;
+  memset(&central_stats, 0, sizeof(central_stats));
+  cached_count = 0;//initialize the cache of emptied mappings
+  cached_bytes = 0;
+  memset(pagemap, 0, sizeof(pagemap));//initialize the slabs
+#ifdef MM_DEFER_COALESCE
+  memset(quick_bins, 0, sizeof(quick_bins));
+  quick_count = 0;
+#endif
+#ifdef MM_THREAD_SAFE
+  memset(&thread_cache, 0, sizeof(thread_cache));//the old heap is gone
+  thread_heap_ptr = NULL;
+  all_heaps = NULL;
+  heap_records = NULL;
+  heap_records_end = NULL;
+#else
+  memset(&main_heap, 0, sizeof(main_heap));
+#endif
+  TRACE_INIT();
   return 0;
 }
 
@@ -107,218 +618,2105 @@ int mm_init(void)
  */
 void* mm_malloc(size_t size)
 {
-  size_t new_size = ALIGN(size + OVERHEAD); 
-  void* p = first_fit(new_size);//To check our free_list to see if we have a block on the current page to allocate
-  
-  if(p == NULL)//If do not find a free block, request more memory
-  {
-    extend(new_size);
-    p = list_header;
-  }
-
-  set_allocated(p, new_size);//allocate
-
+  void* p = allocate(size);
+  TRACE_MALLOC(p, size);
   return p;
 }
 
 /*
- * mm_free - Freeing a block does nothing.
+ * mm_free - Free a block, keeping it in the thread cache if possible.
  */
 void mm_free(void* ptr)
 {
-  size_t ptr_size = GET_SIZE(HDRP(ptr));//get the size of a header pointer, ptr
-  PUT(HDRP(ptr), PACK(ptr_size, 0));//set the size and alloc bit to the header 
-  PUT(FTRP(ptr), PACK(ptr_size, 0));//set the size and alloc bit to the footer
+  TRACE_FREE(ptr);
+  release(ptr);
+}
 
-  void* new_ptr = coalesce(ptr);//coalesce the freed block
+/*
+ * mm_realloc - Resize a block, in place if possible, otherwise by
+ *     allocating a new block, copying the payload and freeing the old one.
+ */
+void* mm_realloc(void* ptr, size_t size)
+{
+  void* new_ptr = reallocate(ptr, size);
+  TRACE_REALLOC(ptr, size, new_ptr);
+  return new_ptr;
+}
 
-  //Check if the block that needs to be freed is the whole page by identifying
-  //its prolog block and its terminator block
-  if(((GET_SIZE(new_ptr - 3 * 8)) == OVERHEAD) && ((GET_SIZE(FTRP(new_ptr) + 8) == 0))) 
+/*
+ * mm_memalign - Allocate a block whose payload is a multiple of alignment,
+ *     which must be a power of two. The space before the aligned payload
+ *     stays a free block, so no more than alignment bytes are set aside.
+ */
+void* mm_memalign(size_t alignment, size_t size)
+{
+  if(alignment == 0 || (alignment & (alignment - 1)) != 0)
   {
-    remove_list_node(new_ptr);
-    size_t page_size = GET_SIZE(HDRP(new_ptr)) + PAGE_OVERHEAD;
-    mem_unmap(new_ptr-PAGE_OVERHEAD, page_size);//mem_unmap for efficiency
+    return NULL;
+  }
+  if(alignment <= ALIGNMENT)//every payload is aligned this much
+  {
+    return mm_malloc(size);
   }
-}
 
-// ******Recommended helper functions******
+  LOCK_HEAP();
+  void* p = central_memalign(alignment, size);
+  UNLOCK_HEAP();
 
-/* These functios will provide a high-level recommended structure to your 
-program.
- * Fill them in as needed, and create additional helper functions 
-   depending on your design.
- */
+  if(p != NULL)
+  {
+    STAT_ADD(MY_HEAP(), mallocs, 1);
+    STAT_ADD(MY_HEAP(), bytes_in_use, object_size(p));
+  }
+  TRACE_MEMALIGN(p, alignment, size);
+  return p;
+}
 
-/* Set a block to allocated
- *  Update block headers/footers as needed
- *  Update free list if applicable
- *  Split block if applicable
+/*
+ * mm_malloc_batch - Allocate count blocks of size bytes into ptrs.
+ *     Blocks from the free lists are cut from as few free blocks as
+ *     possible under one lock. Returns how many blocks were allocated,
+ *     which is less than count only when memory runs out.
  */
-static void set_allocated(void* b, size_t size) 
+size_t mm_malloc_batch(size_t size, size_t count, void** ptrs)
 {
-  size_t pre_size = GET_SIZE(HDRP(b));//get the size of the free block
-  size_t left_size = pre_size - size;//the size left after allocating
-  remove_list_node(b);//update free list
+  thread_heap* heap = MY_HEAP();
+  size_t done = 0;
 
-  // If applicable split the block 
-  if(left_size > PAGE_OVERHEAD) 
+  if(size <= SLAB_MAX_SIZE)//slots are taken without the lock anyway
   {
-    // Update block header and footer for allocated part
-    PUT(HDRP(b), PACK(size, 1));
-    PUT(FTRP(b), PACK(size, 1));
-    // Update the new block's header and footer after splitting
-    PUT(HDRP(NEXT_BLKP(b)), PACK(left_size, 0));
-    PUT(FTRP(NEXT_BLKP(b)), PACK(left_size, 0));
-    add_list_node(NEXT_BLKP(b));//update free list
+    while(done < count && (ptrs[done] = slab_malloc(heap, size)) != NULL)
+    {
+      done++;
+    }
   }
-  else 
-  {//update block header and footer with pre_size
-    PUT(HDRP(b), PACK(pre_size, 1));   
-    PUT(FTRP(b), PACK(pre_size, 1));
+  else
+  {
+    LOCK_HEAP();
+    done = central_malloc_batch(size, count, ptrs);
+    UNLOCK_HEAP();
   }
+
+  size_t i;
+  for(i = 0; i < done; i++)
+  {
+    STAT_ADD(heap, mallocs, 1);
+    STAT_ADD(heap, bytes_in_use, object_size(ptrs[i]));
+    TRACE_MALLOC(ptrs[i], size);
+  }
+  return done;
 }
 
 /*
- * Request more memory by calling mem_map
- *  Initialize the new chunk of memory as applicable
- *  Update free list if applicable
+ * mm_free_batch - Free count blocks, skipping NULL pointers.
+ *     Blocks go straight back to the free lists, under one lock for
+ *     each run of blocks that are not slots.
  */
-static void extend(size_t s) 
+void mm_free_batch(void** ptrs, size_t count)
 {
-  size_t init_size = PAGE_ALIGN((initial_page * 2) + PAGE_OVERHEAD);
-  size_t size;
+  thread_heap* heap = MY_HEAP();
+  int locked = 0;
+  size_t i;
 
-  if(init_size >= ALLOC_GRANULARITY * 100)
+  for(i = 0; i < count; i++)
   {
-    size = PAGE_ALIGN(initial_page + PAGE_OVERHEAD);
+    void* p = ptrs[i];
+    if(p == NULL)
+    {
+      continue;
+    }
+    TRACE_FREE(p);
+    STAT_ADD(heap, frees, 1);
+    STAT_ADD(heap, bytes_in_use, -object_size(p));
+
+    slab* sb = pagemap_get(p);
+    if(sb != NULL)//slot_free may take the lock itself
+    {
+      if(locked)
+      {
+        UNLOCK_HEAP();
+        locked = 0;
+      }
+      slot_free(heap, sb, p);
+      continue;
+    }
+
+    if(!locked)
+    {
+      LOCK_HEAP();
+      locked = 1;
+    }
+    central_free(p);
   }
-  else
+
+  if(locked)
   {
-    size = PAGE_ALIGN(init_size + PAGE_OVERHEAD);
-    initial_page = size; 
+    UNLOCK_HEAP();
   }
-  
-  void* bp = mem_map(size);
-
-  // Prolog
-  PUT(bp, 0);                     
-  bp +=8;
-  PUT(bp, PACK(16, 1));
-  bp +=8;
-  PUT(bp, PACK(16, 1));
-  bp +=8;
-  // Header
-  PUT(bp, PACK(size-PAGE_OVERHEAD, 0));           
-  bp+=8;
-  // Footer
-  PUT(FTRP(bp), PACK(size-PAGE_OVERHEAD, 0));     
-  // Terminator
-  PUT((FTRP(bp)+8), PACK(0,1));
-  
-  add_list_node(bp);//update free list
 }
 
-/* Coalesce a free block if applicable
- *  Returns pointer to new coalesced block
+/*
+ * Allocate a block without tracing the call
  */
-static void* coalesce(void* bp) 
+static void* allocate(size_t size)
 {
-  size_t pre_alloc = GET_ALLOC(HDRP(PREV_BLKP(bp)));
-  size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
-  size_t size = GET_SIZE(HDRP(bp));
+  thread_heap* heap = MY_HEAP();
+  void* p;
 
-  if ((pre_alloc == NULL) && (next_alloc != NULL))//pre is empty 
+#ifdef MM_THREAD_SAFE
+  if(__atomic_load_n(&(*heap).remote_frees, __ATOMIC_RELAXED) != NULL)
   {
-    size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-    PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
-    bp = PREV_BLKP(bp);
+    drain_remote_frees(heap);
   }
-  else if ((pre_alloc != NULL) && (next_alloc == NULL))//next is empty 
+#endif
+
+  if(size <= SLAB_MAX_SIZE)//small requests go to the slabs
   {
-    size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-    remove_list_node(NEXT_BLKP(bp));
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
-    add_list_node(bp);
+    p = slab_malloc(heap, size);
   }
-  else if ((pre_alloc != NULL) && (next_alloc != NULL))
+#ifdef MM_THREAD_SAFE
+  else if(size <= TCACHE_MAX_SIZE)//try the thread cache without the lock
   {
-    add_list_node(bp);
+    p = tcache_malloc(size);
   }
-  else//both empty 
+#endif
+  else
   {
-    size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp)));
-    remove_list_node(NEXT_BLKP(bp));
-    PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-    PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
-    bp = PREV_BLKP(bp);
+    LOCK_HEAP();
+    p = central_malloc(size);
+    UNLOCK_HEAP();
   }
 
-  return bp;
+  if(p != NULL)
+  {
+    STAT_ADD(heap, mallocs, 1);
+    STAT_ADD(heap, bytes_in_use, object_size(p));
+  }
+  return p;
 }
 
 /*
- * Find the next available block by using first fit method
+ * Free a block without tracing the call, keeping it in the thread cache if possible
  */
-static void *first_fit(size_t s) 
+static void release(void* ptr)
 {
-  node* current_node = list_header;
-
-  while (current_node != NULL) 
+  if(ptr == NULL)
   {
-    if (GET_SIZE(HDRP(current_node)) >= s)
-    {
-      return (void*)current_node;
-    }
-    current_node = (*current_node).next;
+    return;
   }
-  return NULL;
-}
 
-/*
- * Add node to the beggining of the free list
- */
-static void add_list_node(void* bp) 
-{
-  node* add_node = (node*)bp;
+  STAT_ADD(MY_HEAP(), frees, 1);
+  STAT_ADD(MY_HEAP(), bytes_in_use, -object_size(ptr));
 
-  // Make next of add node as head and previous as NULL
-  (*add_node).next = list_header;
-  (*add_node).pre = NULL;
+  slab* sb = pagemap_get(ptr);//slots have no header, so ask the page map first
+  if(sb != NULL)
+  {
+    slot_free(MY_HEAP(), sb, ptr);
+    return;
+  }
 
-  // Change pre of head node to add node
-  if(list_header != NULL)
+#ifdef MM_THREAD_SAFE
+  if(tcache_free(ptr))
   {
-    (*list_header).pre = add_node;
+    return;
   }
+#endif
 
-  // Move the head to point to the add node 
-  list_header = add_node;
+  LOCK_HEAP();
+  central_free(ptr);
+  UNLOCK_HEAP();
 }
 
 /*
- * Remove node from the free list
+ * Resize a block without tracing the call
  */
-static void remove_list_node(void* bp) 
+static void* reallocate(void* ptr, size_t size)
 {
-  node* remove_node = (node*)bp;
-  
-  // If node to be removed is head node
-  if (list_header == remove_node)
-  { 
-    list_header = (*remove_node).next; 
-  }
-  // Change next only if node to be removed is not the last node
-  if ((*remove_node).next != NULL) 
+  if(ptr == NULL)
   {
-    (*(*remove_node).next).pre = (*remove_node).pre; 
+    return allocate(size);
   }
-  // Change prev only if node to be removed is not the first node
-  if ((*remove_node).pre != NULL) 
+  if(size == 0)
   {
-    (*(*remove_node).pre).next = (*remove_node).next; 
+    release(ptr);
+    return NULL;
   }
+
+  size_t old_payload;
+  slab* sb = pagemap_get(ptr);
+  if(sb != NULL)
+  {
+    // A slot cannot change size, but it may still be big enough
+    if(size <= (*sb).slot_size)
+    {
+      return ptr;
+    }
+    old_payload = (*sb).slot_size;
+  }
+  else if(GET_HUGE(HDRP(ptr)))
+  {
+    // Keep the mapping while the request is still huge and fits
+    if(size >= HUGE_SIZE && size + HUGE_OVERHEAD <= GET_SIZE(HDRP(ptr)))
+    {
+      return ptr;
+    }
+    old_payload = GET_SIZE(HDRP(ptr)) - HUGE_OVERHEAD;
+  }
+  else
+  {
+#ifdef MM_STATS
+    size_t old_size = GET_SIZE(HDRP(ptr));
+#endif
+    int resized;
+    LOCK_HEAP();
+    resized = resize_in_place(ptr, BLOCK_SIZE(size));
+    UNLOCK_HEAP();
+    if(resized)
+    {
+      STAT_ADD(MY_HEAP(), bytes_in_use, GET_SIZE(HDRP(ptr)) - old_size);
+      return ptr;
+    }
+    old_payload = GET_SIZE(HDRP(ptr)) - sizeof(block_header);
+  }
+
+  void* new_ptr = allocate(size);
+  if(new_ptr == NULL)
+  {
+    return NULL;
+  }
+  memcpy(new_ptr, ptr, old_payload < size ? old_payload : size);
+  release(ptr);
+  return new_ptr;
+}
+
+/*
+ * mm_arena_create - Make an empty arena inside its first chunk.
+ */
+mm_arena* mm_arena_create(void)
+{
+  size_t mapped;
+  LOCK_HEAP();
+  arena_chunk* chunk = (arena_chunk*)map_pages(ARENA_CHUNK, &mapped);
+  UNLOCK_HEAP();
+  if(chunk == NULL)
+  {
+    return NULL;
+  }
+
+  (*chunk).next = NULL;
+  (*chunk).size = mapped;
+  mm_arena* arena = (mm_arena*)((char*)chunk + ALIGN(sizeof(arena_chunk)));
+  (*arena).chunks = chunk;
+  (*arena).bump = (char*)arena + ALIGN(sizeof(mm_arena));
+  (*arena).end = (char*)chunk + mapped;
+  (*arena).next_chunk = 2 * ARENA_CHUNK;
+  return arena;
+}
+
+/*
+ * mm_arena_alloc - Allocate from an arena by bumping a pointer, grabbing
+ *     a new chunk if the current one is full.
+ */
+void* mm_arena_alloc(mm_arena* arena, size_t size)
+{
+  size_t new_size = (size == 0) ? ALIGNMENT : ALIGN(size);
+
+  if((*arena).bump + new_size > (*arena).end)
+  {
+    if(arena_grow(arena, new_size) != 0)
+    {
+      return NULL;
+    }
+  }
+
+  void* p = (*arena).bump;
+  (*arena).bump += new_size;
+  return p;
+}
+
+/*
+ * mm_arena_reset - Free everything allocated from an arena at once.
+ *     Only the first chunk is kept, the others go back to the page cache.
+ */
+void mm_arena_reset(mm_arena* arena)
+{
+  arena_chunk* chunk = (*arena).chunks;
+
+  LOCK_HEAP();
+  while((*chunk).next != NULL)
+  {
+    arena_chunk* next = (*chunk).next;
+    unmap_pages(chunk, (*chunk).size);
+    chunk = next;
+  }
+  UNLOCK_HEAP();
+
+  (*arena).chunks = chunk;
+  (*arena).bump = (char*)arena + ALIGN(sizeof(mm_arena));
+  (*arena).end = (char*)chunk + (*chunk).size;
+  (*arena).next_chunk = 2 * ARENA_CHUNK;
+}
+
+/*
+ * mm_arena_destroy - Free an arena and everything allocated from it.
+ */
+void mm_arena_destroy(mm_arena* arena)
+{
+  arena_chunk* chunk = (*arena).chunks;
+
+  LOCK_HEAP();
+  while(chunk != NULL)
+  {
+    arena_chunk* next = (*chunk).next;
+    unmap_pages(chunk, (*chunk).size);
+    chunk = next;
+  }
+  UNLOCK_HEAP();
+}
+
+/*
+ * Map a new chunk for an arena, big enough for size bytes
+ *  Chunks double in size up to ARENA_MAX_CHUNK, so a growing arena maps
+ *  few of them, and what is left of the old chunk is given up
+ *  Returns -1 if the chunk cannot be mapped
+ */
+static int arena_grow(mm_arena* arena, size_t size)
+{
+  size_t chunk_size = (*arena).next_chunk;
+  size_t mapped;
+
+  if(chunk_size < PAGE_ALIGN(size + ALIGN(sizeof(arena_chunk))))
+  {
+    chunk_size = PAGE_ALIGN(size + ALIGN(sizeof(arena_chunk)));
+  }
+
+  LOCK_HEAP();
+  arena_chunk* chunk = (arena_chunk*)map_pages(chunk_size, &mapped);
+  UNLOCK_HEAP();
+  if(chunk == NULL)
+  {
+    return -1;
+  }
+
+  (*chunk).next = (*arena).chunks;
+  (*chunk).size = mapped;
+  (*arena).chunks = chunk;
+  (*arena).bump = (char*)chunk + ALIGN(sizeof(arena_chunk));
+  (*arena).end = (char*)chunk + mapped;
+  if((*arena).next_chunk < ARENA_MAX_CHUNK)
+  {
+    (*arena).next_chunk *= 2;
+  }
+  return 0;
+}
+
+/*
+ * mm_get_stats - Sum the counters of all threads into stats.
+ *     Without MM_STATS all counters are zero.
+ */
+void mm_get_stats(mm_stats* stats)
+{
+  LOCK_HEAP();
+  *stats = central_stats;
+#ifdef MM_THREAD_SAFE
+  thread_heap* heap;
+  for(heap = all_heaps; heap != NULL; heap = (*heap).next)
+  {
+    (*stats).mallocs += __atomic_load_n(&(*heap).stats.mallocs, __ATOMIC_RELAXED);
+    (*stats).frees += __atomic_load_n(&(*heap).stats.frees, __ATOMIC_RELAXED);
+    (*stats).bytes_in_use += __atomic_load_n(&(*heap).stats.bytes_in_use, __ATOMIC_RELAXED);
+  }
+#else
+  (*stats).mallocs += main_heap.stats.mallocs;
+  (*stats).frees += main_heap.stats.frees;
+  (*stats).bytes_in_use += main_heap.stats.bytes_in_use;
+#endif
+  UNLOCK_HEAP();
+}
+
+/*
+ * mm_heap_walk - Walk every block of every page from prolog to terminator,
+ *     counting allocated and free blocks and sorting free blocks into a
+ *     histogram by size. Slabs and huge blocks are not part of the walk.
+ *     The free space is badly fragmented when largest_free is much smaller
+ *     than free_bytes. Blocks parked by MM_DEFER_COALESCE count as allocated.
+ */
+void mm_heap_walk(mm_heap_report* report)
+{
+  page_link* page;
+
+  memset(report, 0, sizeof(*report));
+  LOCK_HEAP();
+  for(page = all_pages; page != NULL; page = (*page).next)
+  {
+    char* bp = (char*)page + PAGE_OVERHEAD;
+
+    (*report).pages++;
+    while(GET_SIZE(HDRP(bp)) != 0)//stop at the terminator
+    {
+      size_t size = GET_SIZE(HDRP(bp));
+      if(GET_ALLOC(HDRP(bp)))
+      {
+        (*report).allocated_blocks++;
+        (*report).allocated_bytes += size;
+      }
+      else
+      {
+        int bucket = 63 - __builtin_clzl(size);
+        (*report).free_blocks++;
+        (*report).free_bytes += size;
+        (*report).free_histogram[bucket < MM_HIST_BUCKETS ? bucket : MM_HIST_BUCKETS - 1]++;
+        if(size > (*report).largest_free)
+        {
+          (*report).largest_free = size;
+        }
+      }
+      bp = NEXT_BLKP(bp);
+    }
+    (*report).page_bytes += bp - (char*)page;
+  }
+  UNLOCK_HEAP();
+}
+
+/*
+ * Allocate a block from the free lists, the caller holds the heap lock
+ */
+static void* central_malloc(size_t size)
+{
+  if(size >= HUGE_SIZE)
+  {
+    return huge_malloc(size);
+  }
+
+  size_t new_size = BLOCK_SIZE(size); 
+#ifdef MM_DEFER_COALESCE
+  if(new_size <= QUICK_MAX_SIZE && quick_bins[new_size / ALIGNMENT] != NULL)
+  {
+    void* parked = quick_bins[new_size / ALIGNMENT];//still marked allocated
+    quick_bins[new_size / ALIGNMENT] = *(void**)parked;
+    quick_count--;
+    return parked;
+  }
+#endif
+  void* p = find_fit(new_size);//To check our free lists to see if we have a block on the current page to allocate
+  
+  if(p == NULL)//If do not find a free block, request more memory
+  {
+    p = extend(new_size);
+    if(p == NULL)
+    {
+      return NULL;
+    }
+  }
+
+  set_allocated(p, new_size);//allocate
+
+  return p;
+}
+
+/*
+ * Free a block to the free lists, the caller holds the heap lock
+ */
+static void central_free(void* ptr)
+{
+  if(GET_HUGE(HDRP(ptr)))//a huge block is its whole mapping
+  {
+    unmap_pages((char*)ptr - HUGE_OVERHEAD, GET_SIZE(HDRP(ptr)));
+    return;
+  }
+
+#ifdef MM_DEFER_COALESCE
+  size_t size = GET_SIZE(HDRP(ptr));
+  if(size <= QUICK_MAX_SIZE)//park it, its neighbors still see it allocated
+  {
+    if(quick_count >= QUICK_LIMIT)
+    {
+      quick_flush();
+    }
+    *(void**)ptr = quick_bins[size / ALIGNMENT];
+    quick_bins[size / ALIGNMENT] = ptr;
+    quick_count++;
+    return;
+  }
+#endif
+
+  free_block(ptr);
+}
+
+/*
+ * Mark a block free, coalesce it and unmap its page if the page is empty,
+ *  the caller holds the heap lock
+ */
+static void free_block(void* ptr)
+{
+  size_t ptr_size = GET_SIZE(HDRP(ptr));//get the size of a header pointer, ptr
+  PUT(HDRP(ptr), PACK(ptr_size, 0) | GET_PLACE_BITS(HDRP(ptr)));//set the size and alloc bit to the header 
+  PUT(FTRP(ptr), PACK(ptr_size, 0));//a free block needs its footer again
+  CLEAR_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)));
+
+  void* new_ptr = coalesce_and_purge(ptr);//coalesce the freed block
+
+  //Check if the block that needs to be freed is the whole page: it starts
+  //right after the prolog and ends at the terminator
+  if(WHOLE_PAGE(new_ptr)) 
+  {
+    remove_list_node(new_ptr);
+    size_t page_size = GET_SIZE(HDRP(new_ptr)) + PAGE_OVERHEAD;
+    page_link* page = (page_link*)((char*)new_ptr - PAGE_OVERHEAD);
+    if((*page).pre != NULL)//take the page off the list of pages
+    {
+      (*(*page).pre).next = (*page).next;
+    }
+    else
+    {
+      all_pages = (*page).next;
+    }
+    if((*page).next != NULL)
+    {
+      (*(*page).next).pre = (*page).pre;
+    }
+    page_bytes -= page_size;
+    unmap_pages(new_ptr-PAGE_OVERHEAD, page_size);//unmap or cache for efficiency
+  }
+}
+
+/*
+ * Coalesce a block that was just marked free, the caller holds the heap lock
+ *  If the coalesced block is at least PURGE_MIN_SIZE bytes, the pages inside
+ *  it go back to the kernel, unless it is a whole page the caller unmaps
+ *  Every free block that big comes through here, so a free neighbor gave
+ *  back its pages already if it was big enough itself: the range stops at
+ *  such a neighbor and covers a smaller one
+ *  Returns pointer to the coalesced block
+ */
+static void* coalesce_and_purge(void* ptr)
+{
+  size_t ptr_size = GET_SIZE(HDRP(ptr));
+  size_t pre_free = GET_PREV_ALLOC(HDRP(ptr)) ? 0 : GET_SIZE(HDRP(PREV_BLKP(ptr)));
+  size_t next_free = GET_ALLOC(HDRP(NEXT_BLKP(ptr))) ? 0 : GET_SIZE(HDRP(NEXT_BLKP(ptr)));
+
+  void* new_ptr = coalesce(ptr);
+
+  if(GET_SIZE(HDRP(new_ptr)) >= PURGE_MIN_SIZE && !WHOLE_PAGE(new_ptr))
+  {
+    char* start = (char*)new_ptr + sizeof(tree_node);
+    char* end = FTRP(new_ptr);
+    if(pre_free >= PURGE_MIN_SIZE && HDRP(ptr) > start)
+    {
+      start = HDRP(ptr);
+    }
+    if(next_free >= PURGE_MIN_SIZE && HDRP(ptr) + ptr_size < end)
+    {
+      end = HDRP(ptr) + ptr_size;
+    }
+    purge_pages(start, end);
+  }
+  return new_ptr;
+}
+
+/*
+ * Allocate a block with an aligned payload, the caller holds the heap lock
+ *  A free block with room for the payload at any alignment is found, then
+ *  the space before the aligned payload is split off as a free block of at
+ *  least MIN_BLOCK_SIZE, and set_allocated splits off the tail
+ *  Aligned blocks always come from the free lists, even huge ones, since a
+ *  huge block's payload sits at a fixed place in its mapping
+ */
+static void* central_memalign(size_t alignment, size_t size)
+{
+  size_t new_size = BLOCK_SIZE(size);
+  size_t search_size = new_size + alignment + MIN_BLOCK_SIZE;
+  char* bp = (char*)find_fit(search_size);
+
+  if(bp == NULL)
+  {
+    bp = (char*)extend(search_size);
+    if(bp == NULL)
+    {
+      return NULL;
+    }
+  }
+
+  char* p = (char*)(((size_t)bp + alignment - 1) & ~(alignment - 1));
+  if(p != bp && p - bp < MIN_BLOCK_SIZE)//too little room for a free block before it
+  {
+    p += alignment;
+  }
+
+  if(p != bp)
+  {
+    size_t total = GET_SIZE(HDRP(bp));
+    size_t gap = p - bp;
+    remove_list_node(bp);
+    CENTRAL_STAT_ADD(splits, 1);
+    PUT(HDRP(bp), PACK(gap, 0) | GET_PLACE_BITS(HDRP(bp)));
+    PUT(FTRP(bp), PACK(gap, 0));
+    add_list_node(bp);
+    PUT(HDRP(p), PACK(total - gap, 0));//the block before it is free
+    PUT(FTRP(p), PACK(total - gap, 0));
+    add_list_node(p);
+  }
+
+  set_allocated(p, new_size);
+  return p;
+}
+
+/*
+ * Allocate up to count blocks of size bytes, the caller holds the heap lock
+ *  Each free block found holds as many of the blocks as fit in it, so the
+ *  free lists are searched once for many blocks. When no free block holds
+ *  them all, a smaller one is used up first before new pages are mapped
+ *  Returns how many blocks were allocated
+ */
+static size_t central_malloc_batch(size_t size, size_t count, void** ptrs)
+{
+  size_t done = 0;
+
+  if(size >= HUGE_SIZE)
+  {
+    while(done < count && (ptrs[done] = huge_malloc(size)) != NULL)
+    {
+      done++;
+    }
+    return done;
+  }
+
+  size_t new_size = BLOCK_SIZE(size);
+  while(done < count)
+  {
+    size_t left = count - done;
+    if(left > ((size_t)-1 >> 1) / new_size)//no block is that big
+    {
+      left = ((size_t)-1 >> 1) / new_size;
+    }
+
+    void* bp = find_fit(new_size * left);
+    if(bp == NULL)
+    {
+      bp = find_fit(new_size);
+    }
+    if(bp == NULL)
+    {
+      bp = extend(new_size * left);
+    }
+    if(bp == NULL)
+    {
+      break;
+    }
+    done += carve_blocks(bp, new_size, left, ptrs + done);
+  }
+  return done;
+}
+
+/*
+ * Cut a free block into up to count blocks of size bytes
+ *  set_allocated takes them all as one block and splits off the rest,
+ *  then the headers of the blocks inside are written, the last block
+ *  keeping whatever set_allocated did not split off
+ *  Returns how many blocks were cut
+ */
+static size_t carve_blocks(void* bp, size_t size, size_t count, void** ptrs)
+{
+  size_t n = GET_SIZE(HDRP(bp)) / size;
+  if(n > count)
+  {
+    n = count;
+  }
+
+  set_allocated(bp, n * size);
+  size_t total = GET_SIZE(HDRP(bp));
+  size_t bits = GET_PLACE_BITS(HDRP(bp));
+  char* p = (char*)bp;
+  size_t i;
+  for(i = 0; i < n; i++)
+  {
+    size_t block_size = (i == n - 1) ? total - i * size : size;
+    PUT(HDRP(p), PACK(block_size, 1) | bits);
+    bits = PREV_ALLOC_BIT;//every block after the first follows an allocated one
+    ptrs[i] = p;
+    p += block_size;
+  }
+  CENTRAL_STAT_ADD(splits, n - 1);
+  return n;
+}
+
+// ******Recommended helper functions******
+
+/* These functios will provide a high-level recommended structure to your 
+program.
+ * Fill them in as needed, and create additional helper functions 
+   depending on your design.
+ */
+
+/*
+ * Allocate a block with a mapping of its own, the caller holds the heap lock
+ *  The header records the whole mapping, which may be a bit bigger than
+ *  asked for when it comes from the cache
+ */
+static void* huge_malloc(size_t size)
+{
+  size_t mapped;
+  char* bp = (char*)map_pages(PAGE_ALIGN(size + HUGE_OVERHEAD), &mapped);
+  if(bp == NULL)
+  {
+    return NULL;
+  }
+
+  bp += HUGE_OVERHEAD;
+  PUT(HDRP(bp), PACK(mapped, HUGE_BIT | 1));
+  return bp;
+}
+
+/*
+ * Get size bytes of pages, the caller holds the heap lock
+ *  The smallest cached mapping of size to 2 * size bytes is reused,
+ *  otherwise the pages come from mem_map
+ *  The size of what was actually mapped is stored in mapped
+ */
+static void* map_pages(size_t size, size_t* mapped)
+{
+  int best = -1;
+  int i;
+
+  for(i = 0; i < cached_count; i++)
+  {
+    if(cached_sizes[i] >= size && cached_sizes[i] <= 2 * size
+       && (best < 0 || cached_sizes[i] < cached_sizes[best]))
+    {
+      best = i;
+    }
+  }
+
+  if(best < 0)
+  {
+    *mapped = size;
+    return heap_map(size);
+  }
+  return take_cached(best, mapped);
+}
+
+/*
+ * Get size bytes of pages aligned to THP_SIZE, the caller holds the heap lock
+ *  A cached mapping is only reused if it is aligned, otherwise THP_SIZE
+ *  more bytes are mapped and the unaligned head and the tail are unmapped
+ *  The pages are advised as candidates for transparent huge pages
+ */
+static void* map_aligned_pages(size_t size, size_t* mapped)
+{
+  int i;
+
+  for(i = 0; i < cached_count; i++)
+  {
+    if(cached_sizes[i] >= size && cached_sizes[i] <= 2 * size
+       && ((size_t)cached_pages[i] & (THP_SIZE - 1)) == 0)
+    {
+      return take_cached(i, mapped);
+    }
+  }
+
+  char* p = (char*)heap_map(size + THP_SIZE);
+  if(p == NULL)
+  {
+    return NULL;
+  }
+  size_t head = (THP_SIZE - ((size_t)p & (THP_SIZE - 1))) & (THP_SIZE - 1);
+  if(head > 0)
+  {
+    heap_unmap(p, head);
+  }
+  heap_unmap(p + head + size, THP_SIZE - head);
+#ifdef MADV_HUGEPAGE
+  madvise(p + head, size, MADV_HUGEPAGE);
+#endif
+  *mapped = size;
+  return p + head;
+}
+
+/*
+ * Take mapping i out of the cache of emptied mappings, the caller holds the heap lock
+ */
+static void* take_cached(int i, size_t* mapped)
+{
+  void* p = cached_pages[i];
+  *mapped = cached_sizes[i];
+  cached_bytes -= cached_sizes[i];
+  cached_count--;
+  for(; i < cached_count; i++)
+  {
+    cached_pages[i] = cached_pages[i + 1];
+    cached_sizes[i] = cached_sizes[i + 1];
+  }
+  return p;
+}
+
+/*
+ * Give the pages strictly inside start to end back to the kernel,
+ *  the caller holds the heap lock
+ *  They stay mapped and read as zeros, or keep their contents with
+ *  MADV_FREE until the kernel needs the memory
+ */
+static void purge_pages(char* start, char* end)
+{
+  char* first = (char*)PAGE_ALIGN((size_t)start);
+  char* last = (char*)((size_t)end & ~(mem_pagesize() - 1));
+
+  if(first < last)
+  {
+    madvise(first, last - first, PURGE_ADVICE);
+    CENTRAL_STAT_ADD(purges, 1);
+  }
+}
+
+/*
+ * Keep emptied pages in the cache, the caller holds the heap lock
+ *  The oldest mappings are unmapped to make room, and a mapping bigger
+ *  than the whole cache is unmapped right away
+ */
+static void unmap_pages(void* p, size_t size)
+{
+  int i;
+
+  if(size > PAGE_CACHE_BYTES)
+  {
+    heap_unmap(p, size);
+    return;
+  }
+
+  while(cached_count == PAGE_CACHE_SLOTS || cached_bytes + size > PAGE_CACHE_BYTES)
+  {
+    heap_unmap(cached_pages[0], cached_sizes[0]);
+    cached_bytes -= cached_sizes[0];
+    cached_count--;
+    for(i = 0; i < cached_count; i++)
+    {
+      cached_pages[i] = cached_pages[i + 1];
+      cached_sizes[i] = cached_sizes[i + 1];
+    }
+  }
+
+  cached_pages[cached_count] = p;
+  cached_sizes[cached_count] = size;
+  cached_count++;
+  cached_bytes += size;
+}
+
+/*
+ * Call mem_map, counting the mapping, the caller holds the heap lock
+ */
+static void* heap_map(size_t size)
+{
+  void* p = mem_map(size);
+  if(p != NULL)
+  {
+    CENTRAL_STAT_ADD(maps, 1);
+    CENTRAL_STAT_ADD(bytes_mapped, size);
+#ifdef MM_STATS
+    if(central_stats.bytes_mapped > central_stats.peak_mapped)
+    {
+      central_stats.peak_mapped = central_stats.bytes_mapped;
+    }
+#endif
+  }
+  return p;
+}
+
+/*
+ * Call mem_unmap, counting the mapping, the caller holds the heap lock
+ */
+static void heap_unmap(void* p, size_t size)
+{
+  mem_unmap(p, size);
+  CENTRAL_STAT_ADD(unmaps, 1);
+  CENTRAL_STAT_ADD(bytes_mapped, -size);
+}
+
+#ifdef MM_STATS
+/*
+ * Get the size of a block or slot handed out, which is what it costs the heap
+ */
+static size_t object_size(void* p)
+{
+  slab* sb = pagemap_get(p);
+  if(sb != NULL)
+  {
+    return (*sb).slot_size;
+  }
+  return GET_SIZE(HDRP(p));
+}
+#endif
+
+/* Resize an allocated block without moving it, the caller holds the heap lock
+ *  Growing absorbs the next block if it is free and big enough, then the
+ *  tail left over is split off like in set_allocated and freed like in
+ *  free_block, which gives back its pages if it is large
+ *  Returns 0 if the block cannot be resized in place
+ */
+static int resize_in_place(void* bp, size_t size)
+{
+  size_t old_size = GET_SIZE(HDRP(bp));
+  size_t new_size = old_size;
+  size_t bits = GET_PLACE_BITS(HDRP(bp));
+
+  if(size > old_size)
+  {
+    void* next = NEXT_BLKP(bp);
+    if(GET_ALLOC(HDRP(next)) || old_size + GET_SIZE(HDRP(next)) < size)
+    {
+      return 0;
+    }
+    remove_list_node(next);
+    new_size = old_size + GET_SIZE(HDRP(next));
+    PUT(HDRP(bp), PACK(new_size, 1) | bits);
+    SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+  }
+
+  // If applicable split the block, the tail may join a free block after it
+  if(new_size - size > MIN_BLOCK_SIZE)
+  {
+    CENTRAL_STAT_ADD(splits, 1);
+    PUT(HDRP(bp), PACK(size, 1) | bits);
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(new_size - size, PREV_ALLOC_BIT));
+    PUT(FTRP(NEXT_BLKP(bp)), PACK(new_size - size, 0));
+    CLEAR_PREV_ALLOC(HDRP(NEXT_BLKP(NEXT_BLKP(bp))));
+    coalesce_and_purge(NEXT_BLKP(bp));
+  }
+  return 1;
+}
+
+/* Set a block to allocated
+ *  Update block headers/footers as needed
+ *  Update free list if applicable
+ *  Split block if applicable
+ */
+static void set_allocated(void* b, size_t size) 
+{
+  size_t pre_size = GET_SIZE(HDRP(b));//get the size of the free block
+  size_t left_size = pre_size - size;//the size left after allocating
+  size_t bits = GET_PLACE_BITS(HDRP(b));
+  remove_list_node(b);//update free list
+
+  // If applicable split the block 
+  if(left_size > MIN_BLOCK_SIZE) 
+  {
+    CENTRAL_STAT_ADD(splits, 1);
+    // Update block header for allocated part, it has no footer
+    PUT(HDRP(b), PACK(size, 1) | bits);
+    // Update the new block's header and footer after splitting
+    PUT(HDRP(NEXT_BLKP(b)), PACK(left_size, PREV_ALLOC_BIT));
+    PUT(FTRP(NEXT_BLKP(b)), PACK(left_size, 0));
+    add_list_node(NEXT_BLKP(b));//update free list
+  }
+  else 
+  {//update block header with pre_size and tell the next block
+    PUT(HDRP(b), PACK(pre_size, 1) | bits);   
+    SET_PREV_ALLOC(HDRP(NEXT_BLKP(b)));
+  }
+}
+
+/*
+ * Request more memory by calling mem_map, or from the cache of emptied mappings
+ *  Initialize the new chunk of memory as applicable
+ *  Update free list if applicable
+ *  Returns pointer to the new free block, which is at least s bytes
+ */
+static void* extend(size_t s) 
+{
+  size_t init_size = PAGE_ALIGN((initial_page * 2) + PAGE_OVERHEAD);
+  size_t size;
+
+  if(init_size >= ALLOC_GRANULARITY * 100)
+  {
+    size = PAGE_ALIGN(initial_page + PAGE_OVERHEAD);
+  }
+  else
+  {
+    size = PAGE_ALIGN(init_size + PAGE_OVERHEAD);
+    initial_page = size; 
+  }
+
+  // The chunk must hold the request even when it is bigger than the growth policy
+  if(size < PAGE_ALIGN(s + PAGE_OVERHEAD))
+  {
+    size = PAGE_ALIGN(s + PAGE_OVERHEAD);
+  }
+  
+  // Large heaps grow in aligned pieces that can be backed by huge pages
+  void* bp;
+  if(page_bytes + size >= THP_HEAP_SIZE)
+  {
+    size = (size + THP_SIZE - 1) & ~(size_t)(THP_SIZE - 1);
+    bp = map_aligned_pages(size, &size);
+  }
+  else
+  {
+    bp = map_pages(size, &size);
+  }
+  if(bp == NULL)
+  {
+    return NULL;
+  }
+  page_bytes += size;
+
+  // Page links
+  page_link* page = (page_link*)bp;
+  (*page).pre = NULL;
+  (*page).next = all_pages;
+  if(all_pages != NULL)
+  {
+    (*all_pages).pre = page;
+  }
+  all_pages = page;
+  bp += sizeof(page_link);
+
+  // Prolog
+  PUT(bp, 0);                     
+  bp +=8;
+  PUT(bp, PACK(16, 1));
+  bp +=8;
+  PUT(bp, PACK(16, 1));
+  bp +=8;
+  // Header, the prolog before it is allocated
+  PUT(bp, PACK(size-PAGE_OVERHEAD, 0) | PREV_ALLOC_BIT | PAGE_START_BIT);           
+  bp+=8;
+  // Footer
+  PUT(FTRP(bp), PACK(size-PAGE_OVERHEAD, 0));     
+  // Terminator, the block before it is free
+  PUT((FTRP(bp)+8), PACK(0,1));
+  
+  add_list_node(bp);//update free list
+  return bp;
+}
+
+/* Coalesce a free block if applicable
+ *  The block after bp already knows bp is free, and the block before bp
+ *  is only looked at when bp's header says it is free
+ *  Neighbors are taken off their free lists before their size changes,
+ *  since the size decides which list a block lives on
+ *  Returns pointer to new coalesced block
+ */
+static void* coalesce(void* bp) 
+{
+  size_t pre_alloc = GET_PREV_ALLOC(HDRP(bp));
+  size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+  size_t size = GET_SIZE(HDRP(bp));
+
+  if ((pre_alloc == NULL) && (next_alloc != NULL))//pre is empty 
+  {
+    CENTRAL_STAT_ADD(coalesces, 1);
+    size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+    remove_list_node(PREV_BLKP(bp));
+    PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | GET_PLACE_BITS(HDRP(PREV_BLKP(bp))));
+    PUT(FTRP(bp), PACK(size, 0));
+    bp = PREV_BLKP(bp);
+    add_list_node(bp);
+  }
+  else if ((pre_alloc != NULL) && (next_alloc == NULL))//next is empty 
+  {
+    CENTRAL_STAT_ADD(coalesces, 1);
+    size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+    remove_list_node(NEXT_BLKP(bp));
+    PUT(HDRP(bp), PACK(size, 0) | GET_PLACE_BITS(HDRP(bp)));
+    PUT(FTRP(bp), PACK(size, 0));
+    add_list_node(bp);
+  }
+  else if ((pre_alloc != NULL) && (next_alloc != NULL))
+  {
+    add_list_node(bp);
+  }
+  else//both empty 
+  {
+    CENTRAL_STAT_ADD(coalesces, 2);
+    size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp)));
+    remove_list_node(NEXT_BLKP(bp));
+    remove_list_node(PREV_BLKP(bp));
+    PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | GET_PLACE_BITS(HDRP(PREV_BLKP(bp))));
+    PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+    bp = PREV_BLKP(bp);
+    add_list_node(bp);
+  }
+
+  return bp;
+}
+
+/*
+ * Find an available block
+ *  In the deferred coalescing mode, a miss coalesces the parked blocks
+ *  and searches again, before the caller maps new pages
+ */
+static void* find_fit(size_t s)
+{
+  void* bp = good_fit(s);
+#ifdef MM_DEFER_COALESCE
+  if(bp == NULL && quick_count > 0)
+  {
+    quick_flush();
+    bp = good_fit(s);
+  }
+#endif
+  return bp;
+}
+
+/*
+ * Find an available block by using good fit method
+ *  Look at the first few blocks of the request's own list and take the
+ *  smallest one that fits, otherwise take the head of the next non-empty
+ *  larger list, since every block there fits
+ *  Large requests take the best fit from the tree
+ */
+static void* good_fit(size_t s) 
+{
+  if (s >= LARGE_BLOCK_SIZE)
+  {
+    return tree_best_fit(s);
+  }
+
+  int index = list_index(s);
+  node* current_node = free_lists[index];
+  node* best_node = NULL;
+  int scanned;
+
+  for (scanned = 0; current_node != NULL && scanned < GOOD_FIT_SCAN; scanned++)
+  {
+    size_t current_size = GET_SIZE(HDRP(current_node));
+    if (current_size >= s && (best_node == NULL || current_size < GET_SIZE(HDRP(best_node))))
+    {
+      best_node = current_node;
+      if (current_size == s)
+      {
+        break;
+      }
+    }
+    current_node = (*current_node).next;
+  }
+  if (best_node != NULL)
+  {
+    return (void*)best_node;
+  }
+
+  // Find the first non-empty list after index by the bitmap
+  if (index + 1 < NUM_LISTS)
+  {
+    size_t larger = list_bitmap & (~(size_t)0 << (index + 1));
+    if (larger != 0)
+    {
+      return (void*)free_lists[__builtin_ctzl(larger)];
+    }
+  }
+
+  // Nothing larger is free in the lists, so finish scanning the request's own list
+  while (current_node != NULL) 
+  {
+    if (GET_SIZE(HDRP(current_node)) >= s)
+    {
+      return (void*)current_node;
+    }
+    current_node = (*current_node).next;
+  }
+
+  // Split the smallest large block as a last resort
+  return tree_best_fit(s);
+}
+
+/*
+ * Get the index of the free list for a block size
+ *  The index is made of the power of two above the minimum block
+ *  and the next two bits of the size
+ */
+static int list_index(size_t size)
+{
+  int log = 63 - __builtin_clzl(size);
+  int index = ((log - MIN_BLOCK_LOG) << 2) | ((size >> (log - 2)) & 0x3);
+
+  if (index >= NUM_LISTS)
+  {
+    return NUM_LISTS - 1;
+  }
+  return index;
+}
+
+/*
+ * Add node to the beggining of the free list for its size
+ */
+static void add_list_node(void* bp) 
+{
+  CENTRAL_STAT_ADD(free_blocks, 1);
+  if(GET_SIZE(HDRP(bp)) >= LARGE_BLOCK_SIZE)
+  {
+    tree_insert(bp);
+    return;
+  }
+
+  node* add_node = (node*)bp;
+  int index = list_index(GET_SIZE(HDRP(bp)));
+
+  // Make next of add node as head and previous as NULL
+  (*add_node).next = free_lists[index];
+  (*add_node).pre = NULL;
+
+  // Change pre of head node to add node
+  if(free_lists[index] != NULL)
+  {
+    (*free_lists[index]).pre = add_node;
+  }
+
+  // Move the head to point to the add node 
+  free_lists[index] = add_node;
+  list_bitmap |= (size_t)1 << index;
+}
+
+/*
+ * Remove node from the free list for its size
+ */
+static void remove_list_node(void* bp) 
+{
+  CENTRAL_STAT_ADD(free_blocks, -1);
+  if(GET_SIZE(HDRP(bp)) >= LARGE_BLOCK_SIZE)
+  {
+    tree_remove(bp);
+    return;
+  }
+
+  node* remove_node = (node*)bp;
+  int index = list_index(GET_SIZE(HDRP(bp)));
+  
+  // If node to be removed is head node
+  if (free_lists[index] == remove_node)
+  { 
+    free_lists[index] = (*remove_node).next; 
+    if (free_lists[index] == NULL)
+    {
+      list_bitmap &= ~((size_t)1 << index);
+    }
+  }
+  // Change next only if node to be removed is not the last node
+  if ((*remove_node).next != NULL) 
+  {
+    (*(*remove_node).next).pre = (*remove_node).pre; 
+  }
+  // Change prev only if node to be removed is not the first node
+  if ((*remove_node).pre != NULL) 
+  {
+    (*(*remove_node).pre).next = (*remove_node).next; 
+  }
+}
+
+
+// Is the key (size, bp) ordered before the block t
+#define KEY_BEFORE(size, bp, t) \
+  ((size) < GET_SIZE(HDRP(t)) || ((size) == GET_SIZE(HDRP(t)) && (char*)(bp) < (char*)(t)))
+
+// Is the key (size, bp) ordered after the block t
+#define KEY_AFTER(size, bp, t) \
+  ((size) > GET_SIZE(HDRP(t)) || ((size) == GET_SIZE(HDRP(t)) && (char*)(bp) > (char*)(t)))
+
+/*
+ * Top-down splay of the tree t around the key (size, bp)
+ *  The node with the key, or the last node on the search path for it,
+ *  becomes the root, so it is either the closest node before or after
+ *  Returns the new root
+ */
+static tree_node* splay(tree_node* t, size_t size, void* bp)
+{
+  tree_node header;
+  tree_node* left_max = &header;
+  tree_node* right_min = &header;
+  tree_node* y;
+
+  if(t == NULL)
+  {
+    return NULL;
+  }
+  header.left = NULL;
+  header.right = NULL;
+
+  while(1)
+  {
+    if(KEY_BEFORE(size, bp, t))
+    {
+      if((*t).left == NULL)
+      {
+        break;
+      }
+      if(KEY_BEFORE(size, bp, (*t).left))//rotate right
+      {
+        y = (*t).left;
+        (*t).left = (*y).right;
+        (*y).right = t;
+        t = y;
+        if((*t).left == NULL)
+        {
+          break;
+        }
+      }
+      // Link t into the right tree
+      (*right_min).left = t;
+      right_min = t;
+      t = (*t).left;
+    }
+    else if(KEY_AFTER(size, bp, t))
+    {
+      if((*t).right == NULL)
+      {
+        break;
+      }
+      if(KEY_AFTER(size, bp, (*t).right))//rotate left
+      {
+        y = (*t).right;
+        (*t).right = (*y).left;
+        (*y).left = t;
+        t = y;
+        if((*t).right == NULL)
+        {
+          break;
+        }
+      }
+      // Link t into the left tree
+      (*left_max).right = t;
+      left_max = t;
+      t = (*t).right;
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  // Put the left and right trees back under the new root
+  (*left_max).right = (*t).left;
+  (*right_min).left = (*t).right;
+  (*t).left = header.right;
+  (*t).right = header.left;
+  return t;
+}
+
+/*
+ * Add a large free block to the tree, as the new root
+ */
+static void tree_insert(void* bp)
+{
+  tree_node* add_node = (tree_node*)bp;
+  size_t size = GET_SIZE(HDRP(bp));
+
+  if(large_tree == NULL)
+  {
+    (*add_node).left = NULL;
+    (*add_node).right = NULL;
+  }
+  else
+  {
+    large_tree = splay(large_tree, size, bp);
+    if(KEY_BEFORE(size, bp, large_tree))
+    {
+      (*add_node).left = (*large_tree).left;
+      (*add_node).right = large_tree;
+      (*large_tree).left = NULL;
+    }
+    else
+    {
+      (*add_node).right = (*large_tree).right;
+      (*add_node).left = large_tree;
+      (*large_tree).right = NULL;
+    }
+  }
+  large_tree = add_node;
+}
+
+/*
+ * Remove a large free block from the tree
+ *  After splaying the block to the root, the largest node of its left
+ *  subtree is splayed up to replace it
+ */
+static void tree_remove(void* bp)
+{
+  size_t size = GET_SIZE(HDRP(bp));
+  tree_node* root = splay(large_tree, size, bp);
+
+  if((*root).left == NULL)
+  {
+    large_tree = (*root).right;
+  }
+  else
+  {
+    large_tree = splay((*root).left, size, bp);
+    (*large_tree).right = (*root).right;
+  }
+}
+
+/*
+ * Find the smallest large free block of at least s bytes
+ *  Splaying (s, NULL) brings up the best fit or the block just before it,
+ *  in which case the best fit is the leftmost node of the right subtree
+ */
+static void* tree_best_fit(size_t s)
+{
+  tree_node* current_node;
+
+  if(large_tree == NULL)
+  {
+    return NULL;
+  }
+  large_tree = splay(large_tree, s, NULL);
+  if(GET_SIZE(HDRP(large_tree)) >= s)
+  {
+    return (void*)large_tree;
+  }
+
+  current_node = (*large_tree).right;
+  if(current_node == NULL)
+  {
+    return NULL;
+  }
+  while((*current_node).left != NULL)
+  {
+    current_node = (*current_node).left;
+  }
+  return (void*)current_node;
+}
+
+/*
+ * Allocate a slot from the heap's slab class of size
+ *  Take a freed slot if there is one, otherwise the next fresh slot,
+ *  and take the slab off its list once it is full
+ */
+static void* slab_malloc(thread_heap* heap, size_t size)
+{
+  int slab_class = (size == 0) ? 0 : (size - 1) / ALIGNMENT;
+  slab* sb = (*heap).slab_lists[slab_class];
+  void* p;
+
+  if(sb == NULL)
+  {
+    LOCK_HEAP();
+    sb = new_slab(heap, slab_class);
+    UNLOCK_HEAP();
+    if(sb == NULL)
+    {
+      return NULL;
+    }
+  }
+
+  if((*sb).free_slots != NULL)
+  {
+    p = (*sb).free_slots;
+    (*sb).free_slots = *(void**)p;
+  }
+  else
+  {
+    p = (*sb).bump;
+    (*sb).bump += (*sb).slot_size;
+  }
+  (*sb).used++;
+
+  // Full slab, take it off the list until a slot comes back
+  if((*sb).free_slots == NULL && (*sb).bump + (*sb).slot_size > (*sb).end)
+  {
+    (*heap).slab_lists[slab_class] = (*sb).next;
+    if((*sb).next != NULL)
+    {
+      (*(*sb).next).pre = NULL;
+    }
+    (*sb).next = NULL;
+  }
+
+  return p;
+}
+
+/*
+ * Free a slot
+ *  The owner of the slab frees it directly, any other thread pushes it on
+ *  the owner's remote frees. The slabs of an exited thread are freed to
+ *  under the lock, unless a new thread adopted the heap in the meantime
+ */
+static void slot_free(thread_heap* heap, slab* sb, void* p)
+{
+  slab* empty;
+
+#ifdef MM_THREAD_SAFE
+  thread_heap* owner = (*sb).owner;
+  if(owner != heap)
+  {
+    if(__atomic_load_n(&(*owner).alive, __ATOMIC_ACQUIRE))
+    {
+      push_remote_free(owner, p);
+      return;
+    }
+
+    LOCK_HEAP();
+    if((*owner).alive)
+    {
+      push_remote_free(owner, p);
+    }
+    else if((empty = slab_free(sb, p)) != NULL)
+    {
+      release_slab(empty);
+    }
+    UNLOCK_HEAP();
+    return;
+  }
+#else
+  (void)heap;
+#endif
+
+  empty = slab_free(sb, p);
+  if(empty != NULL)
+  {
+    LOCK_HEAP();
+    release_slab(empty);
+    UNLOCK_HEAP();
+  }
+}
+
+/*
+ * Return a slot to its slab
+ *  A full slab goes back on its owner's list, and an empty slab comes off
+ *  the list unless it is the only one left in its class
+ *  Returns the slab if it is empty and should be released
+ */
+static slab* slab_free(slab* sb, void* p)
+{
+  slab** slab_lists = (*(*sb).owner).slab_lists;
+  int slab_class = (*sb).slot_size / ALIGNMENT - 1;
+  int was_full = ((*sb).free_slots == NULL && (*sb).bump + (*sb).slot_size > (*sb).end);
+
+  *(void**)p = (*sb).free_slots;
+  (*sb).free_slots = p;
+  (*sb).used--;
+
+  if(was_full)
+  {
+    (*sb).pre = NULL;
+    (*sb).next = slab_lists[slab_class];
+    if(slab_lists[slab_class] != NULL)
+    {
+      (*slab_lists[slab_class]).pre = sb;
+    }
+    slab_lists[slab_class] = sb;
+  }
+
+  if((*sb).used == 0 && ((*sb).pre != NULL || (*sb).next != NULL))
+  {
+    if((*sb).pre != NULL)
+    {
+      (*(*sb).pre).next = (*sb).next;
+    }
+    else
+    {
+      slab_lists[slab_class] = (*sb).next;
+    }
+    if((*sb).next != NULL)
+    {
+      (*(*sb).next).pre = (*sb).pre;
+    }
+    return sb;
+  }
+  return NULL;
+}
+
+/*
+ * Map a new slab for a slab class and put it on the heap's list
+ *  The caller holds the heap lock
+ */
+static slab* new_slab(thread_heap* heap, int slab_class)
+{
+  size_t mapped;
+  slab* sb = (slab*)map_pages(SLAB_SIZE, &mapped);
+  if(sb == NULL)
+  {
+    return NULL;
+  }
+  if(pagemap_set(sb, mapped, sb) != 0)
+  {
+    pagemap_set(sb, mapped, NULL);
+    unmap_pages(sb, mapped);
+    return NULL;
+  }
+
+  (*sb).pre = NULL;
+  (*sb).next = (*heap).slab_lists[slab_class];
+  if((*heap).slab_lists[slab_class] != NULL)
+  {
+    (*(*heap).slab_lists[slab_class]).pre = sb;
+  }
+  (*sb).owner = heap;
+  (*sb).free_slots = NULL;
+  (*sb).bump = (char*)sb + ALIGN(sizeof(slab));
+  (*sb).end = (char*)sb + mapped;
+  (*sb).slot_size = (slab_class + 1) * ALIGNMENT;
+  (*sb).used = 0;
+  (*heap).slab_lists[slab_class] = sb;
+
+  return sb;
+}
+
+/*
+ * Unmap an empty slab, or keep it in the cache, the caller holds the heap lock
+ */
+static void release_slab(slab* sb)
+{
+  size_t size = (*sb).end - (char*)sb;
+  pagemap_set(sb, size, NULL);
+  unmap_pages(sb, size);
+}
+
+/*
+ * Find the slab that p belongs to, or NULL if p is in a regular page
+ *  Levels are loaded atomically, so threads can read the map without
+ *  the heap lock while another thread adds a level
+ */
+static slab* pagemap_get(void* p)
+{
+  size_t key = (size_t)p >> GRANULE_SHIFT;
+  void** mid = __atomic_load_n(&pagemap[(key >> (2 * PAGEMAP_BITS)) & PAGEMAP_MASK], __ATOMIC_ACQUIRE);
+  if(mid == NULL)
+  {
+    return NULL;
+  }
+
+  slab** leaf = (slab**)__atomic_load_n(&mid[(key >> PAGEMAP_BITS) & PAGEMAP_MASK], __ATOMIC_ACQUIRE);
+  if(leaf == NULL)
+  {
+    return NULL;
+  }
+
+  return leaf[key & PAGEMAP_MASK];
+}
+
+/*
+ * Record sb as the slab of every page from p to p + size
+ *  Missing levels of the page map are mapped on the way
+ *  Returns -1 if a level cannot be mapped
+ */
+static int pagemap_set(void* p, size_t size, slab* sb)
+{
+  size_t key;
+  size_t last = ((size_t)p + size - 1) >> GRANULE_SHIFT;
+
+  for(key = (size_t)p >> GRANULE_SHIFT; key <= last; key++)
+  {
+    void*** root_entry = (void***)&pagemap[(key >> (2 * PAGEMAP_BITS)) & PAGEMAP_MASK];
+    if(*root_entry == NULL)
+    {
+      void** mid = (void**)heap_map(PAGE_ALIGN(PAGEMAP_ENTRIES * sizeof(void*)));
+      if(mid == NULL)
+      {
+        return -1;
+      }
+      __atomic_store_n(root_entry, mid, __ATOMIC_RELEASE);
+    }
+
+    slab*** mid_entry = (slab***)&(*root_entry)[(key >> PAGEMAP_BITS) & PAGEMAP_MASK];
+    if(*mid_entry == NULL)
+    {
+      slab** leaf = (slab**)heap_map(PAGE_ALIGN(PAGEMAP_ENTRIES * sizeof(slab*)));
+      if(leaf == NULL)
+      {
+        return -1;
+      }
+      __atomic_store_n(mid_entry, leaf, __ATOMIC_RELEASE);
+    }
+
+    (*mid_entry)[key & PAGEMAP_MASK] = sb;
+  }
+  return 0;
+}
+
+#ifdef MM_DEFER_COALESCE
+/*
+ * Free and coalesce every parked block, the caller holds the heap lock
+ */
+static void quick_flush(void)
+{
+  int bin;
+  for(bin = 0; bin < QUICK_BINS; bin++)
+  {
+    while(quick_bins[bin] != NULL)
+    {
+      void* p = quick_bins[bin];
+      quick_bins[bin] = *(void**)p;
+      free_block(p);
+    }
+  }
+  quick_count = 0;
+}
+#endif
+
+#ifdef MM_THREAD_SAFE
+/*
+ * Allocate from the thread cache
+ *  An empty bin takes the heap lock once and refills TCACHE_BATCH blocks
+ */
+static void* tcache_malloc(size_t size)
+{
+  int bin = (size - 1) / ALIGNMENT - SLAB_CLASSES;
+  size_t bin_size = (bin + SLAB_CLASSES + 1) * ALIGNMENT;
+  tcache* cache = &thread_cache;
+  void* p = (*cache).bins[bin];
+
+  if(p != NULL)
+  {
+    (*cache).bins[bin] = *(void**)p;
+    (*cache).counts[bin]--;
+    return p;
+  }
+
+  int i;
+  LOCK_HEAP();
+  p = central_malloc(bin_size);
+  for(i = 1; p != NULL && i < TCACHE_BATCH; i++)
+  {
+    void* extra = central_malloc(bin_size);
+    if(extra == NULL)
+    {
+      break;
+    }
+    *(void**)extra = (*cache).bins[bin];
+    (*cache).bins[bin] = extra;
+    (*cache).counts[bin]++;
+  }
+  UNLOCK_HEAP();
+
+  return p;
+}
+
+/*
+ * Keep a freed block in the thread cache, binned by its payload size
+ *  Returns 0 if the block does not fit in the cache
+ */
+static int tcache_free(void* ptr)
+{
+  tcache* cache = &thread_cache;
+  size_t payload = (GET_SIZE(HDRP(ptr)) - sizeof(block_header)) & ~(ALIGNMENT-1);
+
+  if(payload <= SLAB_MAX_SIZE || payload > TCACHE_MAX_SIZE)
+  {
+    return 0;
+  }
+
+  MY_HEAP();//make sure the cache is flushed when this thread exits
+  int bin = payload / ALIGNMENT - 1 - SLAB_CLASSES;
+  if((*cache).counts[bin] >= TCACHE_LIMIT)
+  {
+    tcache_flush(cache, bin, TCACHE_BATCH);
+  }
+
+  *(void**)ptr = (*cache).bins[bin];
+  (*cache).bins[bin] = ptr;
+  (*cache).counts[bin]++;
+  return 1;
+}
+
+/*
+ * Give count blocks of a bin back to the heap under one lock
+ */
+static void tcache_flush(tcache* cache, int bin, int count)
+{
+  LOCK_HEAP();
+  while(count > 0 && (*cache).bins[bin] != NULL)
+  {
+    void* p = (*cache).bins[bin];
+    (*cache).bins[bin] = *(void**)p;
+    (*cache).counts[bin]--;
+    central_free(p);
+    count--;
+  }
+  UNLOCK_HEAP();
+}
+
+/*
+ * Create the key whose destructor flushes a thread's cache
+ */
+static void tcache_make_key(void)
+{
+  pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * Flush the whole cache of an exiting thread and give up its heap
+ *  The slots freed to the heap so far are taken back, and from now on
+ *  its slabs are only touched under the lock
+ */
+static void tcache_destroy(void* cache)
+{
+  int bin;
+  for(bin = 0; bin < TCACHE_BINS; bin++)
+  {
+    tcache_flush((tcache*)cache, bin, TCACHE_LIMIT);
+  }
+
+  thread_heap* heap = thread_heap_ptr;
+  if(heap == NULL)
+  {
+    return;
+  }
+  drain_remote_frees(heap);
+  LOCK_HEAP();
+  __atomic_store_n(&(*heap).alive, 0, __ATOMIC_RELEASE);
+  UNLOCK_HEAP();
+  thread_heap_ptr = NULL;
+}
+
+/*
+ * Give the calling thread a heap
+ *  A heap whose thread exited is adopted with its slabs, otherwise a new
+ *  record is cut from a mapped chunk. Records are never unmapped, since
+ *  other threads may still push remote frees to them
+ */
+static thread_heap* attach_thread_heap(void)
+{
+  thread_heap* heap;
+
+  pthread_once(&tcache_once, tcache_make_key);
+
+  LOCK_HEAP();
+  for(heap = all_heaps; heap != NULL; heap = (*heap).next)
+  {
+    if(!(*heap).alive)
+    {
+      break;
+    }
+  }
+  if(heap == NULL)
+  {
+    if(heap_records == NULL || heap_records + sizeof(thread_heap) > heap_records_end)
+    {
+      heap_records = (char*)heap_map(PAGE_ALIGN(ALLOC_GRANULARITY));
+      if(heap_records == NULL)
+      {
+        UNLOCK_HEAP();
+        return NULL;
+      }
+      heap_records_end = heap_records + PAGE_ALIGN(ALLOC_GRANULARITY);
+    }
+    heap = (thread_heap*)heap_records;
+    heap_records += ALIGN(sizeof(thread_heap));
+    (*heap).next = all_heaps;
+    all_heaps = heap;
+  }
+  __atomic_store_n(&(*heap).alive, 1, __ATOMIC_RELEASE);
+  UNLOCK_HEAP();
+
+  thread_heap_ptr = heap;
+  pthread_setspecific(tcache_key, &thread_cache);
+  return heap;
+}
+
+/*
+ * Push a slot on the remote frees of its owner without the lock
+ *  Many threads may push at once, but only the owner pops, and it
+ *  takes the whole stack at once, so a compare-and-swap is enough
+ */
+static void push_remote_free(thread_heap* owner, void* p)
+{
+  void* head = __atomic_load_n(&(*owner).remote_frees, __ATOMIC_RELAXED);
+  do
+  {
+    *(void**)p = head;
+  }
+  while(!__atomic_compare_exchange_n(&(*owner).remote_frees, &head, p, 1,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Take back the slots other threads freed to a heap and return them to their slabs
+ */
+static void drain_remote_frees(thread_heap* heap)
+{
+  void* p = __atomic_exchange_n(&(*heap).remote_frees, NULL, __ATOMIC_ACQUIRE);
+
+  while(p != NULL)
+  {
+    void* next = *(void**)p;
+    slab* empty = slab_free(pagemap_get(p), p);
+    if(empty != NULL)
+    {
+      LOCK_HEAP();
+      release_slab(empty);
+      UNLOCK_HEAP();
+    }
+    p = next;
+  }
+}
+#endif
+
+#ifdef MM_TRACE
+/*
+ * Open the trace on the first mm_init and record the call
+ *  The buffer is written out when it fills up and when the program exits
+ */
+static void trace_init(void)
+{
+  if(trace_fd < 0)
+  {
+    const char* name = getenv("MM_TRACE_FILE");
+    trace_fd = open(name != NULL ? name : "mm.trace", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(trace_fd < 0)
+    {
+      return;
+    }
+    memcpy(trace_buffer, MM_TRACE_MAGIC, MM_TRACE_MAGIC_SIZE);
+    trace_used = MM_TRACE_MAGIC_SIZE;
+    atexit(trace_flush);
+  }
+
+  if(trace_used + TRACE_MAX_RECORD > TRACE_BUFFER_SIZE)
+  {
+    trace_flush();
+  }
+  trace_buffer[trace_used++] = MM_TRACE_INIT;
+}
+
+/*
+ * Record a call to mm_malloc, a failed one is left out
+ */
+static void trace_malloc(void* p, size_t size)
+{
+  if(trace_fd < 0 || p == NULL)
+  {
+    return;
+  }
+#ifdef MM_THREAD_SAFE
+  pthread_mutex_lock(&trace_lock);
+#endif
+  if(trace_used + TRACE_MAX_RECORD > TRACE_BUFFER_SIZE)
+  {
+    trace_flush();
+  }
+  trace_buffer[trace_used++] = MM_TRACE_MALLOC;
+  trace_put_size(size);
+  trace_put_address(p);
+#ifdef MM_THREAD_SAFE
+  pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+/*
+ * Record a call to mm_free, before the block can be handed out again
+ */
+static void trace_free(void* p)
+{
+  if(trace_fd < 0 || p == NULL)
+  {
+    return;
+  }
+#ifdef MM_THREAD_SAFE
+  pthread_mutex_lock(&trace_lock);
+#endif
+  if(trace_used + TRACE_MAX_RECORD > TRACE_BUFFER_SIZE)
+  {
+    trace_flush();
+  }
+  trace_buffer[trace_used++] = MM_TRACE_FREE;
+  trace_put_address(p);
+#ifdef MM_THREAD_SAFE
+  pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+/*
+ * Record a call to mm_realloc
+ *  Without an old block it is a malloc and with a size of 0 it is a free
+ *  Since the old block may be reused before this is recorded, threads
+ *  that realloc while others allocate can record calls out of order
+ */
+static void trace_realloc(void* p, size_t size, void* new_p)
+{
+  if(p == NULL)
+  {
+    trace_malloc(new_p, size);
+    return;
+  }
+  if(size == 0)
+  {
+    trace_free(p);
+    return;
+  }
+  if(trace_fd < 0 || new_p == NULL)
+  {
+    return;
+  }
+#ifdef MM_THREAD_SAFE
+  pthread_mutex_lock(&trace_lock);
+#endif
+  if(trace_used + TRACE_MAX_RECORD > TRACE_BUFFER_SIZE)
+  {
+    trace_flush();
+  }
+  trace_buffer[trace_used++] = MM_TRACE_REALLOC;
+  trace_put_address(p);
+  trace_put_size(size);
+  trace_put_address(new_p);
+#ifdef MM_THREAD_SAFE
+  pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+/*
+ * Record a call to mm_memalign, a failed one is left out
+ */
+static void trace_memalign(void* p, size_t alignment, size_t size)
+{
+  if(trace_fd < 0 || p == NULL)
+  {
+    return;
+  }
+#ifdef MM_THREAD_SAFE
+  pthread_mutex_lock(&trace_lock);
+#endif
+  if(trace_used + TRACE_MAX_RECORD > TRACE_BUFFER_SIZE)
+  {
+    trace_flush();
+  }
+  trace_buffer[trace_used++] = MM_TRACE_MEMALIGN;
+  trace_put_size(alignment);
+  trace_put_size(size);
+  trace_put_address(p);
+#ifdef MM_THREAD_SAFE
+  pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+/*
+ * Append an unsigned LEB128 varint to the trace
+ */
+static void trace_put_size(size_t size)
+{
+  while(size >= 0x80)
+  {
+    trace_buffer[trace_used++] = (unsigned char)(size | 0x80);
+    size >>= 7;
+  }
+  trace_buffer[trace_used++] = (unsigned char)size;
+}
+
+/*
+ * Append an address to the trace, as the zigzag coded difference to the
+ *  last one, since blocks used together tend to be close
+ */
+static void trace_put_address(void* p)
+{
+  size_t address = (size_t)p / ALIGNMENT;
+  long delta = (long)(address - trace_last);
+
+  trace_last = address;
+  trace_put_size(((size_t)delta << 1) ^ (size_t)(delta >> 63));
 }
 
+/*
+ * Write out what the trace buffer holds
+ */
+static void trace_flush(void)
+{
+  size_t written = 0;
+
+  while(written < trace_used)
+  {
+    ssize_t n = write(trace_fd, trace_buffer + written, trace_used - written);
+    if(n <= 0)
+    {
+      break;
+    }
+    written += n;
+  }
+  trace_used = 0;
+}
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Name: Shirley(Shiyang) Li
+ * UID:  u1160160
+ * mm_ext.h - Entry points of mm.c beyond mm_init, mm_malloc and mm_free.
+ *
+ * mm.h declares the three functions every malloc package has. This file declares
+ * the rest: resizing, aligned and batch allocation, arenas, statistics, the heap
+ * walk and the format of the traces recorded when mm.c is built with MM_TRACE.
+ */
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+#include <stddef.h>
+
+/* number of buckets in the histogram of free block sizes */
+#define MM_HIST_BUCKETS 48
+
+/* a trace starts with this magic, followed by one record per call */
+#define MM_TRACE_MAGIC "MMTRACE1"
+#define MM_TRACE_MAGIC_SIZE 8
+
+/*
+ * The first byte of a record is its kind. Sizes are unsigned LEB128 varints.
+ * Addresses are divided by 16 and stored as a zigzag varint of the difference
+ * to the address in the record before.
+ *  MM_TRACE_INIT      mm_init was called, every block is gone
+ *  MM_TRACE_MALLOC    size, address
+ *  MM_TRACE_FREE      address
+ *  MM_TRACE_REALLOC   old address, size, new address
+ *  MM_TRACE_MEMALIGN  alignment, size, address
+ */
+#define MM_TRACE_INIT 'i'
+#define MM_TRACE_MALLOC 'm'
+#define MM_TRACE_FREE 'f'
+#define MM_TRACE_REALLOC 'r'
+#define MM_TRACE_MEMALIGN 'a'
+
+/* an arena, memory from it is freed all at once */
+typedef struct mm_arena mm_arena;
+
+/* counters from mm_get_stats, only kept when built with MM_STATS */
+typedef struct mm_stats
+{
+  size_t mallocs;
+  size_t frees;
+  size_t bytes_in_use;//blocks, slots and huge mappings handed out
+  size_t bytes_mapped;
+  size_t peak_mapped;
+  size_t maps;//calls to mem_map
+  size_t unmaps;//calls to mem_unmap
+  size_t purges;//calls to madvise giving back the pages inside free blocks
+  size_t free_blocks;//blocks in the free lists and the tree
+  size_t splits;
+  size_t coalesces;
+}mm_stats;
+
+/* what mm_heap_walk found in the pages of blocks */
+typedef struct mm_heap_report
+{
+  size_t pages;
+  size_t page_bytes;
+  size_t allocated_blocks;
+  size_t allocated_bytes;
+  size_t free_blocks;
+  size_t free_bytes;
+  size_t largest_free;
+  size_t free_histogram[MM_HIST_BUCKETS];//free blocks by floor(log2(size))
+}mm_heap_report;
+
+extern void* mm_realloc(void* ptr, size_t size);
+extern void* mm_memalign(size_t alignment, size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t count, void** ptrs);
+extern void mm_free_batch(void** ptrs, size_t count);
+
+extern mm_arena* mm_arena_create(void);
+extern void* mm_arena_alloc(mm_arena* arena, size_t size);
+extern void mm_arena_reset(mm_arena* arena);
+extern void mm_arena_destroy(mm_arena* arena);
+
+extern void mm_get_stats(mm_stats* stats);
+extern void mm_heap_walk(mm_heap_report* report);
+
+#endif
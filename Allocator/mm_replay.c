@@ -0,0 +1,404 @@
+/*
+ * Name: Shirley(Shiyang) Li
+ * UID:  u1160160
+ * mm_replay.c - Replays a trace recorded by mm.c built with MM_TRACE.
+ *
+ * usage: mm_replay [-n passes] <trace file>
+ *
+ * The trace is read and decoded before anything is timed. Addresses in the trace
+ * become dense block ids, so the replay itself is only calls to mm_malloc, mm_free,
+ * mm_realloc and mm_memalign on an array of pointers. After the passes it reports throughput,
+ * the peak of mapped memory and the utilization, which is the peak of live payload
+ * bytes over the peak of mapped bytes. Link it with mm.c built with MM_STATS to get
+ * the peak of mapped memory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mm.h"
+#include "mm_ext.h"
+#include "memlib.h"
+
+/* one call from the trace, on a dense block id */
+typedef struct replay_op
+{
+  char kind;//MM_TRACE_INIT, MM_TRACE_MALLOC, MM_TRACE_FREE, MM_TRACE_REALLOC or MM_TRACE_MEMALIGN
+  unsigned int id;
+  size_t size;
+  size_t alignment;//only for MM_TRACE_MEMALIGN
+}replay_op;
+
+/* an entry of the table from address to block id */
+typedef struct id_entry
+{
+  size_t address;//0 for an empty entry
+  unsigned int id;
+}id_entry;
+
+/* decoded trace */
+typedef struct trace
+{
+  replay_op* ops;
+  size_t num_ops;
+  unsigned int num_ids;//ids run from 0 to num_ids - 1
+  size_t peak_live;//payload bytes, as asked for
+  size_t mallocs;
+  size_t frees;
+  size_t reallocs;
+  size_t memaligns;
+}trace;
+
+static unsigned char* read_trace_file(const char* name, size_t* size);
+static void decode_trace(unsigned char* bytes, size_t size, trace* t);
+static size_t get_size(unsigned char** p, unsigned char* end);
+static size_t get_address(unsigned char** p, unsigned char* end, size_t* last);
+static unsigned int table_take(id_entry* table, size_t mask, size_t address);
+static void table_put(id_entry* table, size_t mask, size_t address, unsigned int id);
+static void free_live(void** blocks, unsigned int num_ids);
+static void error_exit(const char* message);
+
+int main(int argc, char** argv)
+{
+  int passes = 1;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:")) != -1)
+  {
+    if(opt == 'n')
+    {
+      passes = atoi(optarg);
+    }
+    else
+    {
+      error_exit("usage: mm_replay [-n passes] <trace file>");
+    }
+  }
+  if(optind != argc - 1 || passes < 1)
+    error_exit("usage: mm_replay [-n passes] <trace file>");
+
+  size_t size;
+  unsigned char* bytes = read_trace_file(argv[optind], &size);
+  trace t;
+  decode_trace(bytes, size, &t);
+  free(bytes);
+
+  void** blocks = (void**)calloc(t.num_ids > 0 ? t.num_ids : 1, sizeof(void*));
+  if(blocks == NULL)
+    error_exit("unable to allocate the block table");
+
+  mem_init();
+  mm_init();
+
+  struct timespec start, stop;
+  double seconds = 0;
+  int pass;
+  size_t i;
+  for(pass = 0; pass < passes; pass++)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < t.num_ops; i++)
+    {
+      replay_op* op = &t.ops[i];
+      switch(op->kind)
+      {
+      case MM_TRACE_MALLOC:
+        blocks[op->id] = mm_malloc(op->size);
+        break;
+      case MM_TRACE_FREE:
+        mm_free(blocks[op->id]);
+        blocks[op->id] = NULL;
+        break;
+      case MM_TRACE_REALLOC:
+        blocks[op->id] = mm_realloc(blocks[op->id], op->size);
+        break;
+      case MM_TRACE_MEMALIGN:
+        blocks[op->id] = mm_memalign(op->alignment, op->size);
+        break;
+      case MM_TRACE_INIT:
+        free_live(blocks, t.num_ids);//mm_init dropped every block
+        break;
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    seconds += (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+    free_live(blocks, t.num_ids);//start every pass from an empty heap
+  }
+
+  mm_stats stats;
+  mm_get_stats(&stats);
+
+  printf("trace:       %s, %zu calls (%zu mallocs, %zu frees, %zu reallocs, %zu memaligns)\n",
+         argv[optind], t.num_ops, t.mallocs, t.frees, t.reallocs, t.memaligns);
+  printf("time:        %.6f s for %d pass(es), %.0f calls/s\n",
+         seconds, passes, seconds > 0 ? t.num_ops * (double)passes / seconds : 0.0);
+  printf("peak live:   %zu bytes\n", t.peak_live);
+  if(stats.peak_mapped == 0)
+  {
+    printf("peak mapped: unknown, build mm.c with MM_STATS\n");
+  }
+  else
+  {
+    printf("peak mapped: %zu bytes\n", stats.peak_mapped);
+    printf("utilization: %.1f%%\n", 100.0 * t.peak_live / stats.peak_mapped);
+    printf("mem_map:     %zu calls, mem_unmap: %zu calls\n", stats.maps, stats.unmaps);
+  }
+
+  free(blocks);
+  free(t.ops);
+  return 0;
+}
+
+/*
+ * Reads the whole trace file, checking its magic
+ */
+static unsigned char* read_trace_file(const char* name, size_t* size)
+{
+  FILE* file = fopen(name, "rb");
+  if(file == NULL)
+    error_exit("unable to open trace file");
+
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if(length < MM_TRACE_MAGIC_SIZE)
+    error_exit("invalid trace file");
+
+  unsigned char* bytes = (unsigned char*)malloc(length);
+  if(bytes == NULL || fread(bytes, 1, length, file) != (size_t)length)
+    error_exit("unable to read trace file");
+  fclose(file);
+
+  if(memcmp(bytes, MM_TRACE_MAGIC, MM_TRACE_MAGIC_SIZE) != 0)
+    error_exit("invalid trace file");
+
+  *size = length;
+  return bytes;
+}
+
+/*
+ * Decodes the records of a trace into calls on dense block ids
+ *  Ids of freed blocks are reused, so there are only as many ids as
+ *  blocks were live at once
+ */
+static void decode_trace(unsigned char* bytes, size_t size, trace* t)
+{
+  unsigned char* p = bytes + MM_TRACE_MAGIC_SIZE;
+  unsigned char* end = bytes + size;
+  size_t capacity = size;//at most one record per byte
+  size_t table_size = 1024;
+  size_t live = 0;
+  size_t last = 0;
+  unsigned int* free_ids;
+  unsigned int num_free = 0;
+  size_t* sizes;
+  size_t live_count = 0;
+
+  memset(t, 0, sizeof(*t));
+  t->ops = (replay_op*)malloc(capacity * sizeof(replay_op));
+
+  // First pass, only to size the tables by the most blocks live at once
+  unsigned char* q = p;
+  size_t max_live = 0;
+  while(q < end)
+  {
+    char kind = *q++;
+    if(kind == MM_TRACE_MALLOC || kind == MM_TRACE_MEMALIGN)
+    {
+      if(kind == MM_TRACE_MEMALIGN)
+        get_size(&q, end);
+      get_size(&q, end);
+      get_address(&q, end, &last);
+      if(++live_count > max_live)
+        max_live = live_count;
+    }
+    else if(kind == MM_TRACE_FREE)
+    {
+      get_address(&q, end, &last);
+      live_count--;
+    }
+    else if(kind == MM_TRACE_REALLOC)
+    {
+      get_address(&q, end, &last);
+      get_size(&q, end);
+      get_address(&q, end, &last);
+    }
+    else if(kind == MM_TRACE_INIT)
+    {
+      live_count = 0;
+    }
+    else
+      error_exit("invalid record in trace file");
+  }
+  while(table_size < 2 * max_live)
+    table_size *= 2;
+
+  id_entry* table = (id_entry*)calloc(table_size, sizeof(id_entry));
+  free_ids = (unsigned int*)malloc((max_live + 1) * sizeof(unsigned int));
+  sizes = (size_t*)calloc(max_live + 1, sizeof(size_t));
+  if(t->ops == NULL || table == NULL || free_ids == NULL || sizes == NULL)
+    error_exit("unable to allocate memory for the trace");
+
+  last = 0;
+  while(p < end)
+  {
+    replay_op* op = &t->ops[t->num_ops++];
+    op->kind = *p++;
+    if(op->kind == MM_TRACE_MALLOC || op->kind == MM_TRACE_MEMALIGN)
+    {
+      if(op->kind == MM_TRACE_MEMALIGN)
+      {
+        op->alignment = get_size(&p, end);
+        t->memaligns++;
+      }
+      else
+      {
+        t->mallocs++;
+      }
+      op->size = get_size(&p, end);
+      op->id = (num_free > 0) ? free_ids[--num_free] : t->num_ids++;
+      table_put(table, table_size - 1, get_address(&p, end, &last), op->id);
+      sizes[op->id] = op->size;
+      live += op->size;
+    }
+    else if(op->kind == MM_TRACE_FREE)
+    {
+      op->id = table_take(table, table_size - 1, get_address(&p, end, &last));
+      free_ids[num_free++] = op->id;
+      live -= sizes[op->id];
+      t->frees++;
+    }
+    else if(op->kind == MM_TRACE_REALLOC)
+    {
+      op->id = table_take(table, table_size - 1, get_address(&p, end, &last));
+      op->size = get_size(&p, end);
+      table_put(table, table_size - 1, get_address(&p, end, &last), op->id);
+      live += op->size - sizes[op->id];
+      sizes[op->id] = op->size;
+      t->reallocs++;
+    }
+    else
+    {
+      // Every block is gone, so every id is free again
+      memset(table, 0, table_size * sizeof(id_entry));
+      num_free = 0;
+      while(num_free < t->num_ids)
+      {
+        free_ids[num_free] = t->num_ids - 1 - num_free;
+        num_free++;
+      }
+      live = 0;
+    }
+    if(live > t->peak_live)
+      t->peak_live = live;
+  }
+
+  free(table);
+  free(free_ids);
+  free(sizes);
+}
+
+/*
+ * Reads an unsigned LEB128 varint
+ */
+static size_t get_size(unsigned char** p, unsigned char* end)
+{
+  size_t value = 0;
+  int shift = 0;
+
+  while(*p < end)
+  {
+    unsigned char byte = *(*p)++;
+    value |= (size_t)(byte & 0x7F) << shift;
+    if((byte & 0x80) == 0)
+      return value;
+    shift += 7;
+  }
+  error_exit("truncated trace file");
+  return 0;
+}
+
+/*
+ * Reads an address stored as the zigzag coded difference to the last one
+ */
+static size_t get_address(unsigned char** p, unsigned char* end, size_t* last)
+{
+  size_t zigzag = get_size(p, end);
+  size_t delta = (zigzag >> 1) ^ (size_t)(-(long)(zigzag & 1));
+
+  *last += delta;
+  return *last + 1;//0 marks an empty entry of the table
+}
+
+/*
+ * Removes an address from the table and returns its id
+ *  Entries after it in the probe sequence are moved back, so the table
+ *  needs no tombstones
+ */
+static unsigned int table_take(id_entry* table, size_t mask, size_t address)
+{
+  size_t i = (address * 0x9E3779B97F4A7C15UL) & mask;
+
+  while(table[i].address != address)
+  {
+    if(table[i].address == 0)
+      error_exit("trace frees a block it never allocated");
+    i = (i + 1) & mask;
+  }
+  unsigned int id = table[i].id;
+
+  size_t hole = i;
+  for(i = (i + 1) & mask; table[i].address != 0; i = (i + 1) & mask)
+  {
+    size_t home = (table[i].address * 0x9E3779B97F4A7C15UL) & mask;
+    // Move the entry into the hole unless its home lies after the hole
+    if(((i - home) & mask) >= ((i - hole) & mask))
+    {
+      table[hole] = table[i];
+      hole = i;
+    }
+  }
+  table[hole].address = 0;
+  return id;
+}
+
+/*
+ * Adds an address with its id to the table
+ */
+static void table_put(id_entry* table, size_t mask, size_t address, unsigned int id)
+{
+  size_t i = (address * 0x9E3779B97F4A7C15UL) & mask;
+
+  while(table[i].address != 0)
+    i = (i + 1) & mask;
+  table[i].address = address;
+  table[i].id = id;
+}
+
+/*
+ * Frees every block that is still live
+ */
+static void free_live(void** blocks, unsigned int num_ids)
+{
+  unsigned int id;
+  for(id = 0; id < num_ids; id++)
+  {
+    if(blocks[id] != NULL)
+    {
+      mm_free(blocks[id]);
+      blocks[id] = NULL;
+    }
+  }
+}
+
+/*
+ * Prints an error and then exits the program with status 1
+ */
+static void error_exit(const char* message)
+{
+  printf("Error: %s\n", message);
+  exit(1);
+}
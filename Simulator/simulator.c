@@ -16,86 +16,738 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 #include "instruction.h"
 
+// Most levels in a cache model
+#define MAX_CACHE_LEVELS 3
+
+/*
+ * Counters of a profiled run, one per instruction, and where the report goes
+*/
+typedef struct profile
+{
+  unsigned long* entries;//times each basic block, or the rest of one after a ret, was entered
+  unsigned long* taken;//times each conditional jump branched
+  unsigned long* calls;//calls into each instruction
+  struct timespec start;
+  const char* file;
+} profile;
+
+/*
+ * Integers for readr. Input is read in large chunks, or mapped whole, and each
+ * readr parses the next number straight from the bytes.
+*/
+typedef struct input_stream
+{
+  const char* data;//bytes not parsed yet run from next to end
+  size_t next;
+  size_t end;
+  char* buffer;//chunks read from fd, or NULL when data is a mapping
+  size_t mapped_size;
+  size_t offset;//bytes of the input before data, so offset + next have been read
+  int fd;//-1 once everything there is to read is in data
+  int failed;//a readr found no number, so every later one fails too, like scanf
+} input_stream;
+
+/*
+ * Output of printr, written to its file when the buffer fills up and at the end
+ * of the run, or after every line when the file is a terminal
+*/
+typedef struct output_buffer
+{
+  char* data;
+  size_t used;
+  FILE* file;
+  int line_buffered;//the file is a terminal, so lines show up as they are printed like with stdio
+} output_buffer;
+
+/*
+ * State of one run of a program. The stack grows down from stack_top, and a data
+ * segment, when there is one, starts there and runs to the end of memory.
+*/
+typedef struct machine
+{
+  int* registers;
+  unsigned char* memory;
+  unsigned int memory_size;
+  unsigned int stack_top;//%esp at the start, and ret from the top frame halts
+  unsigned int program_counter;//where the run starts, 0 unless it resumes a checkpoint
+  input_stream input;//read by readr
+  output_buffer output;//written by printr
+} machine;
+
+/*
+ * One level of a modelled cache. Each set holds ways lines, and a line is tagged
+ * with its address divided by the line size, plus one so 0 marks an empty way.
+*/
+typedef struct cache_level
+{
+  unsigned int size;
+  unsigned int ways;
+  unsigned int line_size;
+  unsigned int num_sets;
+  unsigned int line_shift;
+  int plru;//tree pseudo-LRU instead of true LRU
+  unsigned int* tags;//ways entries per set
+  unsigned long* used;//LRU: when each way was last used
+  unsigned int* tree;//PLRU: bit n of a set says which half below node n to replace
+  unsigned long clock;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+} cache_level;
+
+/*
+ * Caches between the registers and the simulated memory. An access goes to the
+ * first level, and each miss goes on to the next.
+*/
+typedef struct cache_model
+{
+  cache_level levels[MAX_CACHE_LEVELS];
+  int num_levels;
+  unsigned long reads;
+  unsigned long writes;
+} cache_model;
+
+/*
+ * Where a run writes its checkpoints, and how often
+*/
+typedef struct checkpoint
+{
+  const char* file;
+  unsigned long interval;//instructions between checkpoints, 0 for only on SIGUSR1
+} checkpoint;
+
+// Set by SIGUSR1, and the next block the threaded engine enters takes a checkpoint
+volatile sig_atomic_t checkpoint_requested;
+
 // Forward declarations for helper functions
 unsigned int get_file_size(int file_descriptor);
 unsigned int* load_file(int file_descriptor, unsigned int size);
 instruction_t* decode_instructions(unsigned int* bytes, unsigned int num_instructions);
-unsigned int execute_instruction(unsigned int program_counter, instruction_t* instructions, int* registers, unsigned char* memory);
+instruction_t* map_program(const char* file_name, unsigned int* num_instructions, const char** error);
+int create_memory(machine* m, unsigned int stack_size, const char* data_file, const char** error);
+void destroy_memory(machine* m);
+void open_input(input_stream* in, int file_descriptor);
+int map_input(input_stream* in, const char* file_name);
+void close_input(input_stream* in);
+int read_int(input_stream* in, int* value);
+int open_output(output_buffer* out, FILE* file);
+void flush_output(output_buffer* out);
+void close_output(output_buffer* out);
+void write_register(output_buffer* out, int value);
+unsigned int execute_instruction(unsigned int program_counter, instruction_t* instructions, machine* m);
+unsigned int run_threaded(instruction_t* instructions, unsigned int num_instructions, machine* m, profile* prof,
+                          cache_model* cache, checkpoint* snap);
+unsigned int run_jit(instruction_t* instructions, unsigned int num_instructions, machine* m);
+void run_program(int engine, instruction_t* instructions, unsigned int num_instructions, machine* m, profile* prof,
+                 cache_model* cache, checkpoint* snap);
+void run_batch(const char* list_file, int engine, int num_threads, unsigned int stack_size, const char* data_file);
+void translate_program(instruction_t* instructions, unsigned int num_instructions, unsigned int stack_size,
+                       const char* binary_name, const char* output_name);
+void write_profile(profile* prof, instruction_t* instructions, unsigned int num_instructions);
+void create_cache(cache_model* cache, const char* spec);
+void cache_access(cache_model* cache, unsigned int address, int write);
+void write_cache_report(cache_model* cache);
+void catch_checkpoint_signal(void);
+void write_checkpoint(checkpoint* snap, machine* m, unsigned int program_counter, unsigned int num_instructions);
+void restore_checkpoint(machine* m, const char* file_name, unsigned int num_instructions);
 void print_instructions(instruction_t* instructions, unsigned int num_instructions);
 void error_exit(const char* message);
 
 // 17 registers
 #define NUM_REGS 17
-// 1024-byte stack
+// 1024-byte stack, unless -m asks for another size
 #define STACK_SIZE 1024
+// largest stack -m takes, so every address fits in an int
+#define MAX_STACK_SIZE (1 << 30)
 // maximum signed int
 #define INT_MAX 2147483647
 // minimum signed int 
 #define INT_MIN -2147483648
 
-int main(int argc, char** argv)
-{
-  // Make sure we have enough arguments
-  if(argc < 2)
-    error_exit("must provide an argument specifying a binary file to execute");
+// execution engines, chosen with -e
+#define ENGINE_SWITCH 0
+#define ENGINE_THREADED 1
+#define ENGINE_JIT 2
 
-  // Open the binary file
-  int file_descriptor = open(argv[1], O_RDONLY);
-  if (file_descriptor == -1) 
-    error_exit("unable to open input file");
+// program counter the engines return when the program halts at ret from the top frame
+#define HALTED 0xFFFFFFFF
 
-  // Get the size of the file
-  unsigned int file_size = get_file_size(file_descriptor);
-  // Make sure the file size is a multiple of 4 bytes
-  // since machine code instructions are 4 bytes each
-  if(file_size % 4 != 0)
-    error_exit("invalid input file");
+// bytes read from the input at a time
+#define INPUT_CHUNK (1 << 16)
+// bytes of output collected before they are written
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+// longest line printr writes: "-2147483648 (0x80000000)\n"
+#define MAX_OUTPUT_LINE 32
 
-  // Load the file into memory
-  // We use an unsigned int array to represent the raw bytes
-  // We could use any 4-byte integer type
-  unsigned int* instruction_bytes = load_file(file_descriptor, file_size);
-  close(file_descriptor);
+/*
+ * One pre-decoded instruction for the threaded engine: the address of the
+ * handler that executes it, followed by its operands. Branches and calls also
+ * hold the op they go to, or NULL when their target is not an instruction.
+*/
+typedef struct threaded_op
+{
+  const void* handler;
+  int immediate;
+  unsigned char first_register;
+  unsigned char second_register;
+  struct threaded_op* target;
+} threaded_op;
 
-  unsigned int num_instructions = file_size / 4;
+int main(int argc, char** argv)
+{
+  // Threaded code runs the program unless -e asks for the switch interpreter
+  int engine = ENGINE_THREADED;
+  const char* profile_file = NULL;
+  const char* batch_file = NULL;
+  const char* data_file = NULL;
+  const char* input_file = NULL;
+  const char* translation_file = NULL;
+  const char* cache_spec = NULL;
+  const char* resume_file = NULL;
+  checkpoint snap = {NULL, 0};
+  unsigned int stack_size = STACK_SIZE;
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int option;
+  while((option = getopt(argc, argv, "e:p:b:j:m:d:i:t:c:s:n:r:")) != -1)
+  {
+    if(option == 'm' && strtoul(optarg, NULL, 0) >= 4 && strtoul(optarg, NULL, 0) <= MAX_STACK_SIZE
+       && strtoul(optarg, NULL, 0) % 4 == 0)
+      stack_size = strtoul(optarg, NULL, 0);
+    else if(option == 'd')
+      data_file = optarg;
+    else if(option == 'i')
+      input_file = optarg;
+    else if(option == 't')
+      translation_file = optarg;
+    else if(option == 'c')
+      cache_spec = optarg;
+    else if(option == 's')
+      snap.file = optarg;
+    else if(option == 'n' && strtoul(optarg, NULL, 0) > 0)
+      snap.interval = strtoul(optarg, NULL, 0);
+    else if(option == 'r')
+      resume_file = optarg;
+    else if(option == 'p')
+      profile_file = optarg;
+    else if(option == 'b')
+      batch_file = optarg;
+    else if(option == 'j' && atoi(optarg) > 0)
+      num_threads = atoi(optarg);
+    else if(option == 'e' && strcmp(optarg, "threaded") == 0)
+      engine = ENGINE_THREADED;
+    else if(option == 'e' && strcmp(optarg, "switch") == 0)
+      engine = ENGINE_SWITCH;
+    else if(option == 'e' && strcmp(optarg, "jit") == 0)
+      engine = ENGINE_JIT;
+    else
+      error_exit("usage: simulator [-e threaded|switch|jit] [-m stack bytes] [-d data file] [-i input file] [-p report file]\n"
+                 "                 [-c size:ways:line size[:lru|plru][,...]] [-s checkpoint file [-n instructions]]\n"
+                 "                 [-r checkpoint file] <binary file>\n"
+                 "       simulator [-e threaded|switch|jit] [-m stack bytes] [-d data file] [-j threads] -b <list file>\n"
+                 "       simulator [-m stack bytes] -t <C file> <binary file>");
+  }
+
+  // A batch runs every program in the list, and each gets its own registers,
+  // memory and output
+  if(batch_file != NULL)
+  {
+    if(profile_file != NULL)
+      error_exit("a batch cannot be profiled");
+    if(cache_spec != NULL)
+      error_exit("a batch cannot have a cache model");
+    if(snap.file != NULL || resume_file != NULL)
+      error_exit("a batch cannot take or resume checkpoints");
+    run_batch(batch_file, engine, num_threads > 0 ? num_threads : 1, stack_size, data_file);
+    return 0;
+  }
 
+  // Make sure we have enough arguments
+  if(optind >= argc)
+    error_exit("must provide an argument specifying a binary file to execute");
 
   /****************************************/
   /**** Begin code to modify/implement ****/
   /****************************************/
 
-  // Allocate and decode instructions (left for you to fill in)
-  instruction_t* instructions = decode_instructions(instruction_bytes, num_instructions);
+  // Map the binary file and decode the instructions straight from it
+  unsigned int num_instructions;
+  const char* error;
+  instruction_t* instructions = map_program(argv[optind], &num_instructions, &error);
+  if(instructions == NULL)
+    error_exit(error);
+
+  // -t translates the program to C instead of running it
+  if(translation_file != NULL)
+  {
+    if(data_file != NULL)
+      error_exit("a translation cannot have a data segment");
+    translate_program(instructions, num_instructions, stack_size, argv[optind], translation_file);
+    return 0;
+  }
 
   // Optionally print the decoded instructions for debugging
   // Will not work until you implement decode_instructions
   // Do not call this function in your submitted final version
   //print_instructions(instructions, num_instructions);
 
-  // Allocate and initialize registers
-  int* registers = (int*)malloc(sizeof(int) * NUM_REGS);
-  registers[6] = 1024;//only need to set %esp to be 1024, others are 0
+  // readr reads stdin a chunk at a time, or the file -i names straight from a mapping
+  machine m;
+  if(input_file == NULL)
+    open_input(&m.input, STDIN_FILENO);
+  else if(!map_input(&m.input, input_file))
+    error_exit("unable to open program input");
+  if(!open_output(&m.output, stdout))
+    error_exit("unable to allocate memory for program output");
+
+  // Allocate and initialize registers and memory, %esp starts at the top of the stack.
+  // A resumed run gets them, its program counter and its place in the input from
+  // the checkpoint instead.
+  if(resume_file != NULL)
+  {
+    if(data_file != NULL)
+      error_exit("a resumed run takes its data segment from the checkpoint");
+    restore_checkpoint(&m, resume_file, num_instructions);
+  }
+  else if(!create_memory(&m, stack_size, data_file, &error))
+    error_exit(error);
+
+  // Profiling counts in the threaded engine, whichever engine was asked for
+  profile prof;
+  if(profile_file != NULL)
+  {
+    prof.entries = (unsigned long*)calloc(num_instructions + 1, sizeof(unsigned long));
+    prof.taken = (unsigned long*)calloc(num_instructions + 1, sizeof(unsigned long));
+    prof.calls = (unsigned long*)calloc(num_instructions + 1, sizeof(unsigned long));
+    if(prof.entries == NULL || prof.taken == NULL || prof.calls == NULL)
+      error_exit("unable to allocate memory for the profile");
+    prof.file = profile_file;
+    engine = ENGINE_THREADED;
+  }
+
+  // A cache model also sees the memory accesses in the threaded engine
+  cache_model cache;
+  if(cache_spec != NULL)
+  {
+    create_cache(&cache, cache_spec);
+    engine = ENGINE_THREADED;
+  }
 
-  // Stack memory is byte-addressed, so it must be a 1-byte type
-  unsigned char* memory = (char*)malloc(sizeof(char) * STACK_SIZE);
+  // Checkpoints are taken in the threaded engine too, on SIGUSR1 or every -n instructions
+  if(snap.file != NULL)
+  {
+    catch_checkpoint_signal();
+    engine = ENGINE_THREADED;
+  }
+  else if(snap.interval != 0)
+    error_exit("-n needs a checkpoint file from -s");
 
   // Run the simulation
-  unsigned int program_counter = 0;
+  run_program(engine, instructions, num_instructions, &m, profile_file != NULL ? &prof : NULL,
+              cache_spec != NULL ? &cache : NULL, snap.file != NULL ? &snap : NULL);
+  close_output(&m.output);
+  if(cache_spec != NULL)
+    write_cache_report(&cache);
+
+  
+  return 0;
+}
+
+/*
+ * Runs a program from the machine's program counter until it halts or runs past
+ * its last instruction. The threaded and JIT engines only stop early at a program counter
+ * that is not an instruction, and execute_instruction carries on from there like
+ * it always did.
+*/
+void run_program(int engine, instruction_t* instructions, unsigned int num_instructions, machine* m, profile* prof,
+                 cache_model* cache, checkpoint* snap)
+{
+  unsigned int program_counter = m->program_counter;
+
+  if(engine == ENGINE_THREADED)
+    program_counter = run_threaded(instructions, num_instructions, m, prof, cache, snap);
+  else if(engine == ENGINE_JIT)
+    program_counter = run_jit(instructions, num_instructions, m);
 
   // program_counter is a byte address, so we must multiply num_instructions by 4 
   // to get the address past the last instruction
-  while(program_counter != num_instructions * 4)
+  while(program_counter != num_instructions * 4 && program_counter != HALTED)
   {
-    program_counter = execute_instruction(program_counter, instructions, registers, memory);
+    program_counter = execute_instruction(program_counter, instructions, m);
   }
+}
 
-  
-  return 0;
+/*
+ * Maps a binary file and decodes its instructions straight from the mapping, so
+ * the raw bytes are never copied. Returns NULL, with error set, when the file
+ * cannot be opened or is not a whole number of instructions.
+*/
+instruction_t* map_program(const char* file_name, unsigned int* num_instructions, const char** error)
+{
+  int file_descriptor = open(file_name, O_RDONLY);
+  if(file_descriptor == -1)
+  {
+    *error = "unable to open input file";
+    return NULL;
+  }
+
+  // Machine code instructions are 4 bytes each
+  unsigned int file_size = get_file_size(file_descriptor);
+  if(file_size % 4 != 0)
+  {
+    close(file_descriptor);
+    *error = "invalid input file";
+    return NULL;
+  }
+  *num_instructions = file_size / 4;
+  if(file_size == 0)
+  {
+    close(file_descriptor);
+    return (instruction_t*)calloc(1, sizeof(instruction_t));//nothing to map, or to run
+  }
+
+  unsigned int* bytes = (unsigned int*)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, file_descriptor, 0);
+  close(file_descriptor);
+  if(bytes == MAP_FAILED)
+  {
+    *error = "unable to map input file";
+    return NULL;
+  }
+  madvise(bytes, file_size, MADV_SEQUENTIAL);
+  instruction_t* instructions = decode_instructions(bytes, *num_instructions);
+  munmap(bytes, file_size);
+  return instructions;
+}
+
+/*
+ * Gives a machine zeroed registers and page-backed memory: a stack of stack_size
+ * bytes, followed by a data segment holding the contents of data_file when there
+ * is one. %esp starts at the top of the stack, which is where the data begins.
+ * Returns 0, with error set and nothing left allocated, when the data file cannot
+ * be loaded or there is no memory for the machine.
+*/
+int create_memory(machine* m, unsigned int stack_size, const char* data_file, const char** error)
+{
+  unsigned int data_size = 0;
+  int file_descriptor = -1;
+
+  if(data_file != NULL)
+  {
+    file_descriptor = open(data_file, O_RDONLY);
+    if(file_descriptor == -1)
+    {
+      *error = "unable to open data file";
+      return 0;
+    }
+    data_size = get_file_size(file_descriptor);
+    if(data_size > MAX_STACK_SIZE)
+    {
+      close(file_descriptor);
+      *error = "data file is too large";
+      return 0;
+    }
+  }
+
+  // Pages are only backed once the program touches them, so a big stack costs
+  // nothing until it is used
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t mapped_size = (stack_size + data_size + page - 1) & ~(page - 1);
+  m->memory_size = stack_size + data_size;
+  m->memory = (unsigned char*)mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  m->registers = (int*)calloc(NUM_REGS, sizeof(int));
+  if(m->memory == MAP_FAILED || m->registers == NULL)
+  {
+    if(m->memory != MAP_FAILED)
+      munmap(m->memory, mapped_size);
+    free(m->registers);
+    *error = "unable to allocate memory for the simulated machine";
+    if(file_descriptor != -1)
+      close(file_descriptor);
+    return 0;
+  }
+  m->stack_top = stack_size;
+  m->registers[6] = stack_size;
+  m->program_counter = 0;
+
+  if(file_descriptor != -1)
+  {
+    unsigned int loaded = 0;
+    while(loaded < data_size)
+    {
+      ssize_t num_read = pread(file_descriptor, m->memory + stack_size + loaded, data_size - loaded, loaded);
+      if(num_read <= 0)
+      {
+        close(file_descriptor);
+        destroy_memory(m);
+        *error = "unable to read data file";
+        return 0;
+      }
+      loaded += num_read;
+    }
+    close(file_descriptor);
+  }
+  return 1;
+}
+
+/*
+ * Frees the registers and memory of a machine
+*/
+void destroy_memory(machine* m)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  munmap(m->memory, (m->memory_size + page - 1) & ~(page - 1));
+  free(m->registers);
+}
+
+/*
+ * Sets up input read from a file descriptor a chunk at a time
+*/
+void open_input(input_stream* in, int file_descriptor)
+{
+  in->buffer = (char*)malloc(INPUT_CHUNK);
+  if(in->buffer == NULL)
+    error_exit("unable to allocate memory for program input");
+  in->data = in->buffer;
+  in->next = 0;
+  in->end = 0;
+  in->mapped_size = 0;
+  in->offset = 0;
+  in->fd = file_descriptor;
+  in->failed = 0;
+}
+
+/*
+ * Sets up input parsed straight from a mapping of a whole file, or no input at
+ * all when file_name is NULL. Returns 0 when the file cannot be opened.
+*/
+int map_input(input_stream* in, const char* file_name)
+{
+  in->data = NULL;
+  in->buffer = NULL;
+  in->next = 0;
+  in->end = 0;
+  in->mapped_size = 0;
+  in->offset = 0;
+  in->fd = -1;
+  in->failed = 0;
+  if(file_name == NULL)
+    return 1;
+
+  int file_descriptor = open(file_name, O_RDONLY);
+  if(file_descriptor == -1)
+    return 0;
+  size_t size = get_file_size(file_descriptor);
+  if(size > 0)
+  {
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+    if(mapping == MAP_FAILED)
+    {
+      close(file_descriptor);
+      return 0;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    in->data = (const char*)mapping;
+    in->end = size;
+    in->mapped_size = size;
+  }
+  close(file_descriptor);
+  return 1;
+}
+
+/*
+ * Frees the buffer or the mapping of an input
+*/
+void close_input(input_stream* in)
+{
+  if(in->mapped_size > 0)
+    munmap((void*)in->data, in->mapped_size);
+  free(in->buffer);
+}
+
+/*
+ * Keeps the bytes not parsed yet and reads another chunk after them
+ * Returns 0 once there is nothing more to read
+*/
+static int refill_input(input_stream* in)
+{
+  if(in->fd == -1)
+    return 0;
+  size_t left = in->end - in->next;
+  if(left == INPUT_CHUNK)
+  {
+    // A number longer than a chunk is no number scanf would store either
+    in->failed = 1;
+    return 0;
+  }
+  memmove(in->buffer, in->buffer + in->next, left);
+  in->offset += in->next;
+  in->next = 0;
+  in->end = left;
+  ssize_t num_read = read(in->fd, in->buffer + left, INPUT_CHUNK - left);
+  if(num_read <= 0)
+  {
+    in->fd = -1;
+    return 0;
+  }
+  in->end += num_read;
+  return 1;
+}
+
+/*
+ * Parses the next decimal integer like scanf("%d"): white space is skipped, a
+ * sign is optional and values past the range of an int wrap the way scanf
+ * stores them. Returns 0 and leaves value alone when there is no number.
+*/
+int read_int(input_stream* in, int* value)
+{
+  size_t start;
+  size_t stop;
+  int more = 1;
+
+  if(in->failed)
+    return 0;
+  // Find a whole number in the bytes read so far, reading more when it might go on.
+  // A refill moves the bytes not parsed yet even when it reads nothing, so the
+  // number is found again after the last one.
+  for(;;)
+  {
+    while(in->next < in->end && (in->data[in->next] == ' ' || (in->data[in->next] >= '\t' && in->data[in->next] <= '\r')))
+      in->next++;
+    start = in->next;
+    stop = start;
+    if(stop < in->end && (in->data[stop] == '-' || in->data[stop] == '+'))
+      stop++;
+    while(stop < in->end && in->data[stop] >= '0' && in->data[stop] <= '9')
+      stop++;
+    if(stop < in->end || !more)
+      break;
+    more = refill_input(in);
+  }
+
+  int negative = (start < stop && in->data[start] == '-');
+  size_t digit = start + (start < stop && (in->data[start] == '-' || in->data[start] == '+'));
+  if(digit == stop)
+  {
+    // scanf takes a sign it cannot finish, but stops at anything else, or the end,
+    // every time after
+    if(start < stop)
+      in->next = stop;
+    else
+      in->failed = 1;
+    return 0;
+  }
+
+  // Accumulate like strtol into a long, saturating, then keep the low 32 bits
+  unsigned long magnitude = 0;
+  int saturated = 0;
+  for(; digit < stop; digit++)
+  {
+    if(magnitude > (0x8000000000000000UL - (in->data[digit] - '0')) / 10)
+      saturated = 1;
+    else
+      magnitude = magnitude * 10 + (in->data[digit] - '0');
+  }
+  long number;
+  if(saturated || magnitude > 0x7FFFFFFFFFFFFFFFUL + (unsigned long)negative)
+    number = negative ? (long)0x8000000000000000UL : 0x7FFFFFFFFFFFFFFFL;
+  else
+    number = negative ? (long)(0 - magnitude) : (long)magnitude;
+  *value = (int)number;
+  in->next = stop;
+  return 1;
+}
+
+/*
+ * Sets up output collected in a buffer before it goes to file. A terminal gets
+ * every line at once instead, so a prompt shows before the readr after it.
+ * Returns 0 when there is no memory for the buffer.
+*/
+int open_output(output_buffer* out, FILE* file)
+{
+  out->data = (char*)malloc(OUTPUT_BUFFER_SIZE);
+  if(out->data == NULL)
+    return 0;
+  out->used = 0;
+  out->file = file;
+  out->line_buffered = fileno(file) != -1 && isatty(fileno(file));
+  return 1;
+}
+
+/*
+ * Writes the collected output to its file
+*/
+void flush_output(output_buffer* out)
+{
+  fwrite(out->data, 1, out->used, out->file);
+  out->used = 0;
+}
+
+/*
+ * Writes what is left of the output and frees the buffer
+*/
+void close_output(output_buffer* out)
+{
+  flush_output(out);
+  fflush(out->file);
+  free(out->data);
+}
+
+/*
+ * Adds the line printr prints for a register, the same text as
+ * printf("%d (0x%x)\n"), formatted by hand
+*/
+void write_register(output_buffer* out, int value)
+{
+  static const char hex_digits[] = "0123456789abcdef";
+  char digits[12];
+  int count = 0;
+
+  if(out->used > OUTPUT_BUFFER_SIZE - MAX_OUTPUT_LINE)
+    flush_output(out);
+  char* p = out->data + out->used;
+
+  unsigned int magnitude = (value < 0) ? 0u - (unsigned int)value : (unsigned int)value;
+  if(value < 0)
+    *p++ = '-';
+  do
+  {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while(magnitude != 0);
+  while(count > 0)
+    *p++ = digits[--count];
+
+  *p++ = ' ';
+  *p++ = '(';
+  *p++ = '0';
+  *p++ = 'x';
+  magnitude = (unsigned int)value;
+  do
+  {
+    digits[count++] = hex_digits[magnitude & 0xF];
+    magnitude >>= 4;
+  } while(magnitude != 0);
+  while(count > 0)
+    *p++ = digits[--count];
+  *p++ = ')';
+  *p++ = '\n';
+  out->used = p - out->data;
+
+  if(out->line_buffered)
+  {
+    flush_output(out);
+    fflush(out->file);
+  }
 }
 
 /*
@@ -127,8 +779,11 @@ instruction_t* decode_instructions(unsigned int* bytes, unsigned int num_instruc
 /*
  * Executes a single instruction and returns the next program counter
 */
-unsigned int execute_instruction(unsigned int program_counter, instruction_t* instructions, int* registers, unsigned char* memory)
+unsigned int execute_instruction(unsigned int program_counter, instruction_t* instructions, machine* m)
 {
+  int* registers = m->registers;
+  unsigned char* memory = m->memory;
+
   // program_counter is a byte address, but instructions are 4 bytes each
   // divide by 4 to get the index into the instructions array
   instruction_t instr = instructions[program_counter / 4];
@@ -148,10 +803,10 @@ unsigned int execute_instruction(unsigned int program_counter, instruction_t* in
     registers[instr.first_register] = registers[instr.first_register] + instr.immediate;
     break;
   case printr:
-    printf("%d (0x%x)\n", registers[instr.first_register], registers[instr.first_register]);
+    write_register(&m->output, registers[instr.first_register]);
     break;
   case readr:
-    scanf("%d", &(registers[instr.first_register]));
+    read_int(&m->input, &(registers[instr.first_register]));
     break;
   case imull:
     registers[instr.second_register] = registers[instr.first_register] * registers[instr.second_register];
@@ -183,7 +838,7 @@ unsigned int execute_instruction(unsigned int program_counter, instruction_t* in
     {
       registers[16] = registers[16] | 0x40;
     }
-    if((registers[instr.second_register] - registers[instr.first_register]) < 0)//check if we have SF
+    if((int)((unsigned)registers[instr.second_register] - (unsigned)registers[instr.first_register]) < 0)//check if we have SF, the subtraction wraps like x86
     {
       registers[16] = registers[16] | 0x80;
     }
@@ -237,9 +892,9 @@ unsigned int execute_instruction(unsigned int program_counter, instruction_t* in
     *memory_address= program_counter + 4;
     return program_counter + instr.immediate + 4;
   case ret: 
-    if(registers[6] == 1024)
+    if(registers[6] == (int)m->stack_top)
     {
-      exit(0);
+      return HALTED;
     }
     else
     {
@@ -265,6 +920,1719 @@ unsigned int execute_instruction(unsigned int program_counter, instruction_t* in
   return program_counter + 4;
 }
 
+/*
+ * Returns the flags cmpl sets for these operands
+*/
+static int compare_flags(int second, int first)
+{
+  int flags = 0;
+  if((unsigned)second < (unsigned)first)//CF
+    flags |= 0x1;
+  if(second == first)//ZF
+    flags |= 0x40;
+  if((int)((unsigned)second - (unsigned)first) < 0)//SF
+    flags |= 0x80;
+  if((long)second - (long)first > INT_MAX || (long)second - (long)first < INT_MIN)//OF
+    flags |= 0x800;
+  return flags;
+}
+
+/*
+ * Finds operands of a cmpl that set exactly these flags, so lazy flags can start
+ * from the flags of a resumed run. Every set of flags cmpl can give comes from
+ * some pair of these values.
+ * Returns 0 when no cmpl sets these flags
+*/
+static int compare_operands(int flags, int* second, int* first)
+{
+  static const int values[] = {0, 1, -1, INT_MAX, INT_MIN};
+  int i, j;
+  for(i = 0; i < 5; i++)
+  {
+    for(j = 0; j < 5; j++)
+    {
+      if(compare_flags(values[i], values[j]) == flags)
+      {
+        *second = values[i];
+        *first = values[j];
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Returns whether an instruction uses the flags register, or one past it, as an
+ * operand. Only then must the flags be in register 16 after every cmpl.
+*/
+static int uses_flags_register(instruction_t* instructions, unsigned int num_instructions)
+{
+  unsigned int i;
+  for(i = 0; i < num_instructions; i++)
+  {
+    switch(instructions[i].opcode)
+    {
+    case addl_reg_reg: case imull: case movl_reg_reg: case movl_deref_reg: case movl_reg_deref: case cmpl:
+      if(instructions[i].first_register >= 16 || instructions[i].second_register >= 16)
+        return 1;
+      break;
+    case subl: case addl_imm_reg: case shrl: case movl_imm_reg: case pushl: case popl: case printr: case readr:
+      if(instructions[i].first_register >= 16)
+        return 1;
+      break;
+    default:
+      break;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Finds the first instruction of every basic block: instruction 0, every branch
+ * or call target and every instruction after a branch, call or ret
+ * Returns num_instructions + 1 flags, the last one for the end of the program
+*/
+unsigned char* find_block_leaders(instruction_t* instructions, unsigned int num_instructions)
+{
+  unsigned char* leaders = (unsigned char*)calloc(num_instructions + 1, 1);
+  if(leaders == NULL)
+    error_exit("unable to allocate memory for basic blocks");
+
+  leaders[0] = 1;
+  unsigned int i;
+  for(i = 0; i < num_instructions; i++)
+  {
+    unsigned char opcode = instructions[i].opcode;
+    if(opcode >= je && opcode <= ret)
+    {
+      unsigned int target = i * 4 + instructions[i].immediate + 4;
+      if(opcode != ret && target % 4 == 0 && target / 4 <= num_instructions)
+        leaders[target / 4] = 1;
+      leaders[i + 1] = 1;
+    }
+  }
+  return leaders;
+}
+
+// Threaded code dispatch: jump to the handler of the next instruction, or of a target
+#define NEXT() goto *(++op)->handler
+#define JUMP_TO(target)                                                 \
+  do                                                                    \
+  {                                                                     \
+    program_counter = (target);                                         \
+    if(program_counter % 4 != 0 || program_counter / 4 > num_instructions) \
+      goto stop;                                                        \
+    op = ops + program_counter / 4;                                     \
+    goto *op->handler;                                                  \
+  } while(0)
+#define BRANCH()                                                        \
+  do                                                                    \
+  {                                                                     \
+    if(op->target == NULL)                                              \
+    {                                                                   \
+      program_counter = (unsigned int)(op - ops) * 4 + op->immediate + 4; \
+      goto stop;                                                        \
+    }                                                                   \
+    branched = op;                                                      \
+    op = op->target;                                                    \
+    goto *op->handler;                                                  \
+  } while(0)
+// Skips the second op of a superinstruction, which the first one already executed
+#define NEXT_FUSED() goto *(op += 2)->handler
+
+/*
+ * Runs the program with threaded code, starting at the machine's program counter
+ * Every instruction is decoded once into the address of its handler, and each
+ * handler jumps straight to the handler of the next instruction, so there is no
+ * call, copy or switch per instruction. The registers and flags live in a local
+ * array for the whole run and are copied back when it stops.
+ * Unless an instruction reads the flags register, cmpl only keeps its operands
+ * and each conditional jump compares them for just the flags it tests.
+ * Branch targets are resolved to ops while decoding, and common pairs of
+ * instructions are fused into one handler so they take one dispatch.
+ * With a profile, the first op of every basic block goes through a handler that
+ * counts entries to the block and sees where the block before it went, and the
+ * report is written when the program halts or runs past its last instruction.
+ * Without one, no handler looks at the profile at all.
+ * With a cache model, every instruction that reads or writes memory first goes
+ * through a handler that passes the address to the model, and pairs of stack ops
+ * are not fused so each access is seen. Without one, nothing changes.
+ * With a checkpoint file, the first op of every basic block goes through a
+ * handler that counts the instructions of the block, and takes a checkpoint
+ * once at least the interval has run since the last one or SIGUSR1 asked for
+ * one.
+ * Returns HALTED at ret from the top frame, num_instructions * 4 when the program
+ * runs past its last instruction, or a program counter that is not an
+ * instruction, which is left to execute_instruction
+*/
+unsigned int run_threaded(instruction_t* instructions, unsigned int num_instructions, machine* m, profile* prof,
+                          cache_model* cache, checkpoint* snap)
+{
+  static const void* handlers[32] = {
+    [subl] = &&op_subl, [addl_reg_reg] = &&op_addl_reg_reg, [addl_imm_reg] = &&op_addl_imm_reg,
+    [imull] = &&op_imull, [shrl] = &&op_shrl, [movl_reg_reg] = &&op_movl_reg_reg,
+    [movl_deref_reg] = &&op_movl_deref_reg, [movl_reg_deref] = &&op_movl_reg_deref,
+    [movl_imm_reg] = &&op_movl_imm_reg, [cmpl] = &&op_cmpl, [je] = &&op_je, [jl] = &&op_jl,
+    [jle] = &&op_jle, [jge] = &&op_jge, [jbe] = &&op_jbe, [jmp] = &&op_jmp, [call] = &&op_call,
+    [ret] = &&op_ret, [pushl] = &&op_pushl, [popl] = &&op_popl, [printr] = &&op_printr,
+    [readr] = &&op_readr
+  };
+  // Handlers that leave the flags unevaluated until a conditional jump tests them
+  static const void* lazy_handlers[32] = {
+    [cmpl] = &&op_cmpl_lazy, [je] = &&op_je_lazy, [jl] = &&op_jl_lazy, [jle] = &&op_jle_lazy,
+    [jge] = &&op_jge_lazy, [jbe] = &&op_jbe_lazy
+  };
+  // Superinstructions of a lazy cmpl and the conditional jump after it
+  static const void* compare_and_branch[32] = {
+    [je] = &&op_cmpl_je, [jl] = &&op_cmpl_jl, [jle] = &&op_cmpl_jle, [jge] = &&op_cmpl_jge,
+    [jbe] = &&op_cmpl_jbe
+  };
+
+  int* registers = m->registers;
+  unsigned char* memory = m->memory;
+  int stack_top = m->stack_top;
+
+  // Flags are only kept in register 16 when some instruction reads it. Lazy flags
+  // start from operands of a cmpl that give the flags the machine has.
+  int compared_second = 1;
+  int compared_first = 0;
+  int lazy = !uses_flags_register(instructions, num_instructions)
+             && compare_operands(registers[16], &compared_second, &compared_first);
+
+  // One more op past the last instruction stops the run
+  threaded_op* ops = (threaded_op*)malloc((num_instructions + 1) * sizeof(threaded_op));
+  if(ops == NULL)
+    error_exit("unable to allocate memory for threaded code");
+  unsigned int i;
+  for(i = 0; i < num_instructions; i++)
+  {
+    ops[i].handler = handlers[instructions[i].opcode & 0x1F];
+    if(ops[i].handler == NULL)//opcodes without an instruction do nothing, like in execute_instruction
+      ops[i].handler = &&op_nop;
+    if(lazy && lazy_handlers[instructions[i].opcode & 0x1F] != NULL)
+      ops[i].handler = lazy_handlers[instructions[i].opcode & 0x1F];
+    ops[i].immediate = instructions[i].immediate;
+    ops[i].first_register = instructions[i].first_register;
+    ops[i].second_register = instructions[i].second_register;
+    if(instructions[i].opcode == cmpl && (instructions[i].first_register == 16 || instructions[i].second_register == 16))
+      ops[i].handler = &&op_cmpl_flags;
+    unsigned int target = i * 4 + instructions[i].immediate + 4;
+    ops[i].target = NULL;
+    if(instructions[i].opcode >= je && instructions[i].opcode <= call && target % 4 == 0 && target / 4 <= num_instructions)
+      ops[i].target = ops + target / 4;
+  }
+  ops[num_instructions].handler = &&op_end;
+
+  // Peephole pass: the first op of a common pair gets a handler that executes
+  // both. The second op keeps its own handler, so jumping straight to it works.
+  // A profile counts and checkpoints are taken at the start of every block, so
+  // then pairs never span two blocks.
+  unsigned char* leaders = (prof != NULL || snap != NULL) ? find_block_leaders(instructions, num_instructions) : NULL;
+  for(i = 0; i + 1 < num_instructions; i++)
+  {
+    instruction_t* first = &instructions[i];
+    instruction_t* second = &instructions[i + 1];
+    if(leaders != NULL && leaders[i + 1])
+      continue;
+    // Pairs of stack ops leave %esp itself alone
+    int stack_pair = first->first_register != 6 && second->first_register != 6;
+    if(ops[i].handler == &&op_cmpl_lazy && compare_and_branch[second->opcode & 0x1F] != NULL)
+      ops[i].handler = compare_and_branch[second->opcode & 0x1F];
+    else if(first->opcode == pushl && second->opcode == popl && stack_pair && cache == NULL)
+      ops[i].handler = &&op_pushl_popl;
+    else if(first->opcode == pushl && second->opcode == pushl && stack_pair && cache == NULL)
+      ops[i].handler = &&op_pushl_pushl;
+    else if(first->opcode == popl && second->opcode == popl && stack_pair && cache == NULL)
+      ops[i].handler = &&op_popl_popl;
+    else if(first->opcode == movl_imm_reg && second->opcode == addl_reg_reg)
+      ops[i].handler = &&op_movl_imm_addl;
+    else
+      continue;
+    i++;//the second op of a pair does not start another one
+  }
+
+  // The first op of each block goes to the counting handler, which then goes to
+  // its own, and ret counts a return into the middle of a block
+  const void** profiled_handlers = NULL;
+  unsigned int* block_last = NULL;//index of the last op in the block of each op
+  threaded_op* last = NULL;//op that ended the block before, to see where it went
+  threaded_op* branched = NULL;//op that last took its branch, even to the op after it
+  if(leaders != NULL)
+  {
+    block_last = (unsigned int*)malloc((num_instructions + 1) * sizeof(unsigned int));
+    if(block_last == NULL)
+      error_exit("unable to allocate memory for threaded code");
+    block_last[num_instructions] = num_instructions;
+    for(i = num_instructions; i-- > 0;)
+      block_last[i] = leaders[i + 1] ? i : block_last[i + 1];
+  }
+  if(prof != NULL)
+  {
+    profiled_handlers = (const void**)malloc((num_instructions + 1) * sizeof(void*));
+    if(profiled_handlers == NULL)
+      error_exit("unable to allocate memory for the profile");
+    for(i = 0; i <= num_instructions; i++)
+    {
+      if(i < num_instructions && instructions[i].opcode == ret)
+        ops[i].handler = &&op_ret_profiled;
+      profiled_handlers[i] = ops[i].handler;
+      if(leaders[i])
+        ops[i].handler = &&op_profile;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &prof->start);
+  }
+
+  // Ops that touch memory go to the cache model first, then to their own
+  // handler, which may be the profile's
+  const void** cached_handlers = NULL;
+  if(cache != NULL)
+  {
+    cached_handlers = (const void**)malloc((num_instructions + 1) * sizeof(void*));
+    if(cached_handlers == NULL)
+      error_exit("unable to allocate memory for the cache model");
+    for(i = 0; i < num_instructions; i++)
+    {
+      cached_handlers[i] = ops[i].handler;
+      unsigned char opcode = instructions[i].opcode;
+      if(opcode == movl_deref_reg || opcode == movl_reg_deref || opcode == pushl || opcode == popl
+         || opcode == call || opcode == ret)
+        ops[i].handler = &&op_cache;
+    }
+  }
+
+  // The first op of each block counts down to the next checkpoint before it
+  // goes to its own handler
+  const void** checkpoint_handlers = NULL;
+  long countdown = 0;//instructions left until the next checkpoint
+  if(snap != NULL)
+  {
+    checkpoint_handlers = (const void**)malloc((num_instructions + 1) * sizeof(void*));
+    if(checkpoint_handlers == NULL)
+      error_exit("unable to allocate memory for checkpoints");
+    for(i = 0; i < num_instructions; i++)
+    {
+      checkpoint_handlers[i] = ops[i].handler;
+      if(leaders[i])
+        ops[i].handler = &&op_checkpoint;
+    }
+    countdown = (snap->interval != 0) ? (long)snap->interval : -1;
+  }
+
+  // Register fields are 5 bits, so 32 slots keep any of them inside the array
+  int regs[32] = {0};
+  memcpy(regs, registers, sizeof(int) * NUM_REGS);
+
+  threaded_op* op = ops + m->program_counter / 4;
+  unsigned int program_counter;
+  int* memory_address;
+  goto *op->handler;
+
+ op_subl:
+  regs[op->first_register] = regs[op->first_register] - op->immediate;
+  NEXT();
+ op_addl_reg_reg:
+  regs[op->second_register] = regs[op->first_register] + regs[op->second_register];
+  NEXT();
+ op_addl_imm_reg:
+  regs[op->first_register] = regs[op->first_register] + op->immediate;
+  NEXT();
+ op_imull:
+  regs[op->second_register] = regs[op->first_register] * regs[op->second_register];
+  NEXT();
+ op_shrl:
+  regs[op->first_register] = (unsigned)regs[op->first_register] >> 1;
+  NEXT();
+ op_movl_reg_reg:
+  regs[op->second_register] = regs[op->first_register];
+  NEXT();
+ op_movl_deref_reg:
+  memory_address = (int*)&(memory[regs[op->first_register] + op->immediate]);
+  regs[op->second_register] = *memory_address;
+  NEXT();
+ op_movl_reg_deref:
+  memory_address = (int*)&(memory[regs[op->second_register] + op->immediate]);
+  *memory_address = regs[op->first_register];
+  NEXT();
+ op_movl_imm_reg:
+  regs[op->first_register] = op->immediate;
+  NEXT();
+ op_cmpl:
+  regs[16] = compare_flags(regs[op->second_register], regs[op->first_register]);
+  NEXT();
+ op_cmpl_lazy:
+  compared_second = regs[op->second_register];
+  compared_first = regs[op->first_register];
+  NEXT();
+ op_cmpl_flags:
+  // Comparing the flags register itself sees each flag as soon as it is set,
+  // exactly like execute_instruction
+  regs[16] = 0;
+  if((unsigned)regs[op->second_register] < (unsigned)regs[op->first_register])
+    regs[16] |= 0x1;
+  if(regs[op->second_register] - regs[op->first_register] == 0)
+    regs[16] |= 0x40;
+  if((int)((unsigned)regs[op->second_register] - (unsigned)regs[op->first_register]) < 0)
+    regs[16] |= 0x80;
+  if((long)regs[op->second_register] - (long)regs[op->first_register] > INT_MAX
+     || (long)regs[op->second_register] - (long)regs[op->first_register] < INT_MIN)
+    regs[16] |= 0x800;
+  NEXT();
+ op_je:
+  if((regs[16] & 0x40) == 0x40)//ZF
+    BRANCH();
+  NEXT();
+ op_jl:
+  if(((regs[16] & 0x80) == 0x80) ^ ((regs[16] & 0x400) == 0x400))//the same bits execute_instruction tests
+    BRANCH();
+  NEXT();
+ op_jle:
+  if((((regs[16] & 0x80) == 0x80) ^ ((regs[16] & 0x800) == 0x800)) | ((regs[16] & 0x40) == 0x40))//(SF xor OF) or ZF
+    BRANCH();
+  NEXT();
+ op_jge:
+  if(!(((regs[16] & 0x80) == 0x80) ^ ((regs[16] & 0x800) == 0x800)))//not(SF xor OF)
+    BRANCH();
+  NEXT();
+ op_jbe:
+  if((regs[16] & 0x1) | ((regs[16] & 0x40) == 0x40))//CF or ZF
+    BRANCH();
+  NEXT();
+ op_cmpl_je:
+  compared_second = regs[op->second_register];
+  compared_first = regs[op->first_register];
+  op++;
+  if(compared_second == compared_first)
+    BRANCH();
+  NEXT();
+ op_cmpl_jl:
+  compared_second = regs[op->second_register];
+  compared_first = regs[op->first_register];
+  op++;
+  if((int)((unsigned)compared_second - (unsigned)compared_first) < 0)
+    BRANCH();
+  NEXT();
+ op_cmpl_jle:
+  compared_second = regs[op->second_register];
+  compared_first = regs[op->first_register];
+  op++;
+  if(compared_second <= compared_first)
+    BRANCH();
+  NEXT();
+ op_cmpl_jge:
+  compared_second = regs[op->second_register];
+  compared_first = regs[op->first_register];
+  op++;
+  if(compared_second >= compared_first)
+    BRANCH();
+  NEXT();
+ op_cmpl_jbe:
+  compared_second = regs[op->second_register];
+  compared_first = regs[op->first_register];
+  op++;
+  if((unsigned)compared_second <= (unsigned)compared_first)
+    BRANCH();
+  NEXT();
+ op_je_lazy:
+  if(compared_second == compared_first)//ZF
+    BRANCH();
+  NEXT();
+ op_jl_lazy:
+  if((int)((unsigned)compared_second - (unsigned)compared_first) < 0)//SF
+    BRANCH();
+  NEXT();
+ op_jle_lazy:
+  if(compared_second <= compared_first)//(SF xor OF) or ZF is a signed compare
+    BRANCH();
+  NEXT();
+ op_jge_lazy:
+  if(compared_second >= compared_first)//not(SF xor OF)
+    BRANCH();
+  NEXT();
+ op_jbe_lazy:
+  if((unsigned)compared_second <= (unsigned)compared_first)//CF or ZF is an unsigned compare
+    BRANCH();
+  NEXT();
+ op_jmp:
+  BRANCH();
+ op_call:
+  regs[6] = regs[6] - 4;
+  memory_address = (int*)&(memory[regs[6]]);
+  *memory_address = (unsigned int)(op - ops) * 4 + 4;
+  BRANCH();
+ op_ret:
+  if(regs[6] == stack_top)
+  {
+    program_counter = HALTED;
+    goto stop;
+  }
+  memory_address = (int*)&(memory[regs[6]]);
+  regs[6] = regs[6] + 4;
+  JUMP_TO(*memory_address);
+ op_pushl:
+  regs[6] = regs[6] - 4;
+  memory_address = (int*)&(memory[regs[6]]);
+  *memory_address = regs[op->first_register];
+  NEXT();
+ op_popl:
+  memory_address = (int*)&(memory[regs[6]]);
+  regs[op->first_register] = *memory_address;
+  regs[6] = regs[6] + 4;
+  NEXT();
+ op_pushl_popl:
+  memory_address = (int*)&(memory[regs[6] - 4]);
+  *memory_address = regs[op->first_register];
+  regs[(op + 1)->first_register] = *memory_address;
+  NEXT_FUSED();
+ op_pushl_pushl:
+  regs[6] = regs[6] - 8;
+  memory_address = (int*)&(memory[regs[6]]);
+  memory_address[1] = regs[op->first_register];
+  memory_address[0] = regs[(op + 1)->first_register];
+  NEXT_FUSED();
+ op_popl_popl:
+  memory_address = (int*)&(memory[regs[6]]);
+  regs[op->first_register] = memory_address[0];
+  regs[(op + 1)->first_register] = memory_address[1];
+  regs[6] = regs[6] + 8;
+  NEXT_FUSED();
+ op_movl_imm_addl:
+  regs[op->first_register] = op->immediate;
+  regs[(op + 1)->second_register] = regs[(op + 1)->first_register] + regs[(op + 1)->second_register];
+  NEXT_FUSED();
+ op_printr:
+  write_register(&m->output, regs[op->first_register]);
+  NEXT();
+ op_readr:
+  read_int(&m->input, &(regs[op->first_register]));
+  NEXT();
+ op_nop:
+  NEXT();
+ op_profile:
+  i = op - ops;
+  prof->entries[i]++;
+  if(last != NULL && instructions[last - ops].opcode >= je && instructions[last - ops].opcode <= jbe && branched == last)
+    prof->taken[last - ops]++;
+  else if(last != NULL && instructions[last - ops].opcode == call)
+    prof->calls[i]++;
+  last = ops + block_last[i];
+  branched = NULL;
+  goto *profiled_handlers[i];
+ op_ret_profiled:
+  memory_address = (int*)&(memory[regs[6]]);
+  i = (unsigned int)*memory_address / 4;
+  if((unsigned int)*memory_address % 4 == 0 && i < num_instructions && !leaders[i])
+  {
+    // Returning into the middle of a block enters the rest of it
+    prof->entries[i]++;
+    last = ops + block_last[i];
+  }
+  goto op_ret;
+ op_cache:
+  i = op - ops;
+  switch(instructions[i].opcode)
+  {
+  case movl_deref_reg:
+    cache_access(cache, regs[op->first_register] + op->immediate, 0);
+    break;
+  case movl_reg_deref:
+    cache_access(cache, regs[op->second_register] + op->immediate, 1);
+    break;
+  case pushl: case call:
+    cache_access(cache, regs[6] - 4, 1);
+    break;
+  case popl:
+    cache_access(cache, regs[6], 0);
+    break;
+  default://ret, which reads nothing when it halts
+    if(regs[6] != stack_top)
+      cache_access(cache, regs[6], 0);
+    break;
+  }
+  goto *cached_handlers[i];
+ op_checkpoint:
+  i = op - ops;
+  if(countdown > 0)
+  {
+    countdown -= block_last[i] - i + 1;
+    if(countdown <= 0)
+      checkpoint_requested = 1;
+  }
+  if(checkpoint_requested)
+  {
+    checkpoint_requested = 0;
+    countdown = (snap->interval != 0) ? (long)snap->interval : -1;
+    memcpy(registers, regs, sizeof(int) * NUM_REGS);
+    if(lazy)
+      registers[16] = compare_flags(compared_second, compared_first);
+    write_checkpoint(snap, m, i * 4, num_instructions);
+  }
+  goto *checkpoint_handlers[i];
+ op_end:
+  program_counter = num_instructions * 4;
+
+ stop:
+  // Running past the last instruction, halting, or handing off to execute_instruction
+  if(prof != NULL)
+    write_profile(prof, instructions, num_instructions);
+  if(lazy)
+    regs[16] = compare_flags(compared_second, compared_first);
+  memcpy(registers, regs, sizeof(int) * NUM_REGS);
+  free(ops);
+  free(profiled_handlers);
+  free(cached_handlers);
+  free(checkpoint_handlers);
+  free(block_last);
+  free(leaders);
+  return program_counter;
+}
+
+#if defined(__x86_64__)
+
+// Most bytes one instruction and the stub of its branch target translate to
+#define JIT_MAX_CODE 80
+
+/*
+ * Registers and flags the native code works on. rbx points at regs, and the
+ * operands of the last cmpl sit just below it, so a conditional jump compares
+ * them again instead of reading flags out of register 16
+*/
+typedef struct jit_state
+{
+  int compared_second;//flags are those of compared_second - compared_first
+  int compared_first;
+  int regs[32];
+} jit_state;
+
+/*
+ * Native code being written, and the jumps in it to blocks that may not be
+ * translated yet
+*/
+typedef struct jit_buffer
+{
+  unsigned char* code;
+  unsigned int used;
+  unsigned int* fixups;//offset of the rel32 of each jump
+  unsigned int* fixup_targets;//program counter each jump goes to
+  unsigned int num_fixups;
+} jit_buffer;
+
+// Entry of the native code: regs, memory, table of blocks by instruction and the block to start at
+typedef unsigned int (*jit_function)(int* regs, unsigned char* memory, void** blocks, void* entry);
+
+static void jit_printr(machine* m, int value)
+{
+  write_register(&m->output, value);
+}
+
+static void jit_readr(machine* m, int* value)
+{
+  read_int(&m->input, value);
+}
+
+static void emit(jit_buffer* jit, const char* bytes, unsigned int count)
+{
+  memcpy(jit->code + jit->used, bytes, count);
+  jit->used += count;
+}
+
+static void emit_int(jit_buffer* jit, unsigned int value)
+{
+  memcpy(jit->code + jit->used, &value, 4);
+  jit->used += 4;
+}
+
+/*
+ * Emits an instruction whose operand is [rbx + 4 * reg], the simulated register
+ * reg, with host the host register or opcode extension in its ModRM byte
+*/
+static void emit_register(jit_buffer* jit, const char* opcode, unsigned int count, int host, int reg)
+{
+  emit(jit, opcode, count);
+  jit->code[jit->used++] = 0x43 | host << 3;
+  jit->code[jit->used++] = reg * 4;
+}
+
+/*
+ * Emits a jump with a rel32 to code already written
+*/
+static void emit_jump_back(jit_buffer* jit, const char* opcode, unsigned int count, unsigned int offset)
+{
+  emit(jit, opcode, count);
+  emit_int(jit, offset - (jit->used + 4));
+}
+
+/*
+ * Emits a jump to the block at a program counter, patched once every block is written
+*/
+static void emit_jump_to(jit_buffer* jit, const char* opcode, unsigned int count, unsigned int target)
+{
+  emit(jit, opcode, count);
+  jit->fixups[jit->num_fixups] = jit->used;
+  jit->fixup_targets[jit->num_fixups++] = target;
+  emit_int(jit, 0);
+}
+
+/*
+ * Translates one instruction at index i to native code
+ *  %eax and %ecx are scratch, %rbx holds the simulated registers, %r12 the
+ *  simulated memory and %r13 the table of blocks by instruction
+*/
+static void jit_instruction(jit_buffer* jit, instruction_t instr, unsigned int i, unsigned int num_instructions, unsigned int bad_return, machine* m)
+{
+  // Condition codes of the native jcc that tests what each conditional jump tests
+  static const unsigned char conditions[] = {
+    [je] = 0x84,//ZF
+    [jl] = 0x88,//only SF, since execute_instruction tests a bit cmpl never sets for OF
+    [jle] = 0x8E,//(SF xor OF) or ZF
+    [jge] = 0x8D,//not(SF xor OF)
+    [jbe] = 0x86//CF or ZF
+  };
+  unsigned int target = i * 4 + instr.immediate + 4;
+  int first = instr.first_register;
+  int second = instr.second_register;
+  char jcc[2] = {0x0F, 0};
+
+  switch(instr.opcode)
+  {
+  case subl:
+    emit_register(jit, "\x81", 1, 5, first);//sub $imm, reg
+    emit_int(jit, instr.immediate);
+    break;
+  case addl_reg_reg:
+    emit_register(jit, "\x8B", 1, 0, first);//mov reg, %eax
+    emit_register(jit, "\x01", 1, 0, second);//add %eax, reg
+    break;
+  case addl_imm_reg:
+    emit_register(jit, "\x81", 1, 0, first);//add $imm, reg
+    emit_int(jit, instr.immediate);
+    break;
+  case imull:
+    emit_register(jit, "\x8B", 1, 0, first);
+    emit_register(jit, "\x0F\xAF", 2, 0, second);//imul reg, %eax
+    emit_register(jit, "\x89", 1, 0, second);
+    break;
+  case shrl:
+    emit_register(jit, "\xD1", 1, 5, first);//shr reg
+    break;
+  case movl_reg_reg:
+    emit_register(jit, "\x8B", 1, 0, first);
+    emit_register(jit, "\x89", 1, 0, second);
+    break;
+  case movl_deref_reg:
+    emit_register(jit, "\x8B", 1, 0, first);
+    emit(jit, "\x05", 1);//add $imm, %eax
+    emit_int(jit, instr.immediate);
+    emit(jit, "\x48\x63\xC0" "\x41\x8B\x04\x04", 7);//movslq %eax, %rax; mov (%r12,%rax), %eax
+    emit_register(jit, "\x89", 1, 0, second);
+    break;
+  case movl_reg_deref:
+    emit_register(jit, "\x8B", 1, 0, second);
+    emit(jit, "\x05", 1);
+    emit_int(jit, instr.immediate);
+    emit(jit, "\x48\x63\xC0", 3);
+    emit_register(jit, "\x8B", 1, 1, first);//mov reg, %ecx
+    emit(jit, "\x41\x89\x0C\x04", 4);//mov %ecx, (%r12,%rax)
+    break;
+  case movl_imm_reg:
+    emit_register(jit, "\xC7", 1, 0, first);//mov $imm, reg
+    emit_int(jit, instr.immediate);
+    break;
+  case cmpl:
+    emit_register(jit, "\x8B", 1, 0, second);
+    emit(jit, "\x89\x43\xF8", 3);//mov %eax, compared_second
+    emit_register(jit, "\x8B", 1, 0, first);
+    emit(jit, "\x89\x43\xFC", 3);//mov %eax, compared_first
+    break;
+  case je: case jl: case jle: case jge: case jbe:
+    emit(jit, "\x8B\x43\xF8" "\x3B\x43\xFC", 6);//compared_second - compared_first
+    jcc[1] = conditions[instr.opcode];
+    emit_jump_to(jit, jcc, 2, target);
+    break;
+  case jmp:
+    emit_jump_to(jit, "\xE9", 1, target);
+    break;
+  case call:
+    emit(jit, "\x83\x6B\x18\x04" "\x48\x63\x43\x18", 8);//subl $4, %esp; movslq %esp, %rax
+    emit(jit, "\x41\xC7\x04\x04", 4);//movl $return, (%r12,%rax)
+    emit_int(jit, i * 4 + 4);
+    emit_jump_to(jit, "\xE9", 1, target);
+    break;
+  case ret:
+    emit(jit, "\x81\x7B\x18", 3);//cmpl $stack_top, %esp
+    emit_int(jit, m->stack_top);
+    emit_jump_to(jit, "\x0F\x84", 2, HALTED);
+    emit(jit, "\x48\x63\x43\x18" "\x41\x8B\x0C\x04" "\x83\x43\x18\x04", 12);//pop the return address into %ecx
+    // Only a return address that starts a block has native code to go to
+    emit_jump_back(jit, "\xF6\xC1\x03\x0F\x85", 5, bad_return);//test $3, %cl; jnz
+    emit(jit, "\x81\xF9", 2);//cmp $end, %ecx
+    emit_int(jit, num_instructions * 4);
+    emit_jump_back(jit, "\x0F\x87", 2, bad_return);
+    emit(jit, "\x49\x8B\x44\x4D\x00" "\x48\x85\xC0", 8);//mov (%r13,%rcx,2), %rax; test %rax, %rax
+    emit_jump_back(jit, "\x0F\x84", 2, bad_return);
+    emit(jit, "\xFF\xE0", 2);//jmp *%rax
+    break;
+  case pushl:
+    emit(jit, "\x83\x6B\x18\x04" "\x48\x63\x43\x18", 8);
+    emit_register(jit, "\x8B", 1, 1, first);
+    emit(jit, "\x41\x89\x0C\x04", 4);
+    break;
+  case popl:
+    emit(jit, "\x48\x63\x43\x18" "\x41\x8B\x0C\x04", 8);
+    emit_register(jit, "\x89", 1, 1, first);
+    emit(jit, "\x83\x43\x18\x04", 4);//addl $4, %esp
+    break;
+  case printr:
+  case readr:
+    emit(jit, "\x48\xBF", 2);//movabs $m, %rdi
+    emit(jit, (const char*)&m, 8);
+    if(instr.opcode == printr)
+      emit_register(jit, "\x8B", 1, 6, first);//mov reg, %esi
+    else
+      emit_register(jit, "\x48\x8D", 2, 6, first);//lea reg, %rsi
+    emit(jit, "\x48\xB8", 2);//movabs $helper, %rax; call *%rax
+    void (*helper)(void) = (instr.opcode == printr) ? (void (*)(void))jit_printr : (void (*)(void))jit_readr;
+    emit(jit, (const char*)&helper, 8);
+    emit(jit, "\xFF\xD0", 2);
+    break;
+  }
+}
+
+/*
+ * Runs the program as native x86-64 code, starting at the machine's program counter
+ * The instructions are split into basic blocks, and every block is translated
+ * once, before the run, into an mmap'd buffer. Blocks end in direct jumps to the
+ * blocks they branch to, and falling through needs no jump at all since blocks
+ * are laid out in program order, so native code only leaves itself to halt or
+ * at a program counter that is not an instruction. ret jumps through a table of
+ * blocks by instruction. printr and readr call back into C.
+ * Programs that use the flags register as an operand, and runs that resume in
+ * the middle of a block, are run by run_threaded.
+ * Returns like run_threaded
+*/
+unsigned int run_jit(instruction_t* instructions, unsigned int num_instructions, machine* m)
+{
+  jit_state state;
+  memset(&state, 0, sizeof(state));
+  if(uses_flags_register(instructions, num_instructions)
+     || !compare_operands(m->registers[16], &state.compared_second, &state.compared_first))
+    return run_threaded(instructions, num_instructions, m, NULL, NULL, NULL);
+  unsigned char* leaders = find_block_leaders(instructions, num_instructions);
+  if(!leaders[m->program_counter / 4])
+  {
+    free(leaders);
+    return run_threaded(instructions, num_instructions, m, NULL, NULL, NULL);
+  }
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = ((size_t)(num_instructions + 1) * JIT_MAX_CODE + 64 + page - 1) & ~(page - 1);
+  jit_buffer jit;
+  jit.code = (unsigned char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(jit.code == MAP_FAILED)
+  {
+    free(leaders);
+    return run_threaded(instructions, num_instructions, m, NULL, NULL, NULL);
+  }
+  jit.used = 0;
+  jit.num_fixups = 0;
+  // ret has two jumps that need patching, everything else at most one
+  jit.fixups = (unsigned int*)malloc(num_instructions * 2 * sizeof(unsigned int) + 1);
+  jit.fixup_targets = (unsigned int*)malloc(num_instructions * 2 * sizeof(unsigned int) + 1);
+  unsigned int* offsets = (unsigned int*)calloc(num_instructions + 1, sizeof(unsigned int));
+  void** blocks = (void**)calloc(num_instructions + 1, sizeof(void*));
+  if(jit.fixups == NULL || jit.fixup_targets == NULL || offsets == NULL || blocks == NULL)
+    error_exit("unable to allocate memory for the JIT");
+
+  // Save the registers the native code keeps its bases in, and jump to the entry block
+  emit(&jit, "\x53\x41\x54\x41\x55" "\x48\x89\xFB\x49\x89\xF4\x49\x89\xD5" "\xFF\xE1", 16);
+  unsigned int leave = jit.used;
+  emit(&jit, "\x41\x5D\x41\x5C\x5B\xC3", 6);//restore them and return %eax
+  unsigned int halt = jit.used;
+  emit(&jit, "\xB8", 1);
+  emit_int(&jit, HALTED);
+  emit_jump_back(&jit, "\xE9", 1, leave);
+  unsigned int bad_return = jit.used;
+  emit(&jit, "\x89\xC8", 2);//the return address is the program counter to stop at
+  emit_jump_back(&jit, "\xE9", 1, leave);
+
+  unsigned int i;
+  for(i = 0; i <= num_instructions; i++)
+  {
+    if(leaders[i])
+    {
+      offsets[i] = jit.used;
+      blocks[i] = jit.code + jit.used;
+    }
+    if(i < num_instructions)
+      jit_instruction(&jit, instructions[i], i, num_instructions, bad_return, m);
+  }
+  // Running past the last instruction stops the program
+  emit(&jit, "\xB8", 1);
+  emit_int(&jit, num_instructions * 4);
+  emit_jump_back(&jit, "\xE9", 1, leave);
+
+  // Chain every jump to its block, or to a stub that stops at a bad target
+  for(i = 0; i < jit.num_fixups; i++)
+  {
+    unsigned int target = jit.fixup_targets[i];
+    unsigned int offset;
+    if(target == HALTED)
+    {
+      offset = halt;
+    }
+    else if(target % 4 == 0 && target / 4 <= num_instructions)
+    {
+      offset = offsets[target / 4];
+    }
+    else
+    {
+      offset = jit.used;
+      emit(&jit, "\xB8", 1);
+      emit_int(&jit, target);
+      emit_jump_back(&jit, "\xE9", 1, leave);
+    }
+    unsigned int rel = offset - (jit.fixups[i] + 4);
+    memcpy(jit.code + jit.fixups[i], &rel, 4);
+  }
+  if(mprotect(jit.code, size, PROT_READ | PROT_EXEC) != 0)
+    error_exit("unable to make the JIT code executable");
+
+  memcpy(state.regs, m->registers, sizeof(int) * NUM_REGS);
+
+  unsigned int program_counter = ((jit_function)jit.code)(state.regs, m->memory, blocks,
+                                                          blocks[m->program_counter / 4]);
+
+  memcpy(m->registers, state.regs, sizeof(int) * NUM_REGS);
+  m->registers[16] = compare_flags(state.compared_second, state.compared_first);
+  munmap(jit.code, size);
+  free(jit.fixups);
+  free(jit.fixup_targets);
+  free(offsets);
+  free(blocks);
+  free(leaders);
+  return program_counter;
+}
+
+#else
+
+/*
+ * There is no JIT for this host, so the threaded engine runs the program
+*/
+unsigned int run_jit(instruction_t* instructions, unsigned int num_instructions, machine* m)
+{
+  return run_threaded(instructions, num_instructions, m, NULL, NULL, NULL);
+}
+
+#endif
+
+/*
+ * Writes the C expression for a conditional jump's condition, on the flags in
+ * r16 exactly as execute_instruction tests them, or on the operands of the last
+ * cmpl when the flags are lazy
+*/
+static void write_condition(FILE* file, unsigned char opcode, int lazy)
+{
+  static const char* eager_conditions[32] = {
+    [je] = "(r16 & 0x40) == 0x40",
+    [jl] = "((r16 & 0x80) == 0x80) ^ ((r16 & 0x400) == 0x400)",
+    [jle] = "(((r16 & 0x80) == 0x80) ^ ((r16 & 0x800) == 0x800)) | ((r16 & 0x40) == 0x40)",
+    [jge] = "!(((r16 & 0x80) == 0x80) ^ ((r16 & 0x800) == 0x800))",
+    [jbe] = "(r16 & 0x1) | ((r16 & 0x40) == 0x40)"
+  };
+  static const char* lazy_conditions[32] = {
+    [je] = "compared_second == compared_first",
+    [jl] = "(int)((unsigned)compared_second - (unsigned)compared_first) < 0",
+    [jle] = "compared_second <= compared_first",
+    [jge] = "compared_second >= compared_first",
+    [jbe] = "(unsigned)compared_second <= (unsigned)compared_first"
+  };
+  fputs(lazy ? lazy_conditions[opcode] : eager_conditions[opcode], file);
+}
+
+/*
+ * Writes the C statement that goes to a program counter: a goto when it is an
+ * instruction, or the end of the program
+*/
+static void write_jump(FILE* file, unsigned int target, unsigned int num_instructions)
+{
+  if(target % 4 == 0 && target / 4 <= num_instructions)
+    fprintf(file, "goto L%u;", target);
+  else
+    fprintf(file, "bad_program_counter(%uu);", target);
+}
+
+/*
+ * Translates a program to a standalone C source file
+ * Every instruction becomes a labelled C statement that does what
+ * execute_instruction does, on registers held in local variables and a stack
+ * of the same size. Branches and calls are gotos, and ret goes through a table
+ * of the addresses of every label. Unless an instruction reads the flags
+ * register, cmpl only keeps its operands like the threaded engine does. A jump
+ * to a program counter that is not an instruction stops the program with an
+ * error, since the translation has no code for it.
+*/
+void translate_program(instruction_t* instructions, unsigned int num_instructions, unsigned int stack_size,
+                       const char* binary_name, const char* output_name)
+{
+  FILE* file = fopen(output_name, "w");
+  if(file == NULL)
+    error_exit("unable to open translation output file");
+  int lazy = !uses_flags_register(instructions, num_instructions);
+  unsigned int i;
+
+  fprintf(file, "/*\n * Translated from %s, %u instructions, by the simulator\n */\n\n", binary_name, num_instructions);
+  fprintf(file, "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n\n");
+  fprintf(file, "#define STACK_SIZE %u\n\n", stack_size);
+  fprintf(file, "static unsigned char memory[STACK_SIZE];\n\n");
+  fprintf(file, "static int load(int address)\n{\n  int value;\n  memcpy(&value, &memory[address], 4);\n  return value;\n}\n\n");
+  fprintf(file, "static void store(int address, int value)\n{\n  memcpy(&memory[address], &value, 4);\n}\n\n");
+  fprintf(file, "static int read_register(int value)\n{\n  scanf(\"%%d\", &value);\n  return value;\n}\n\n");
+  fprintf(file, "static void bad_program_counter(unsigned int program_counter)\n{\n"
+                "  fprintf(stderr, \"Error: program counter %%u is not an instruction\\n\", program_counter);\n"
+                "  exit(1);\n}\n\n");
+
+  fprintf(file, "int main(void)\n{\n  static void* const labels[] = {\n");
+  for(i = 0; i <= num_instructions; i++)
+    fprintf(file, "    &&L%u,\n", i * 4);
+  fprintf(file, "  };\n");
+
+  // Only the registers the program names become variables, %esp is always one
+  unsigned int used_registers = 1u << 6;
+  if(!lazy)
+    used_registers |= 1u << 16;
+  for(i = 0; i < num_instructions; i++)
+    used_registers |= (1u << instructions[i].first_register) | (1u << instructions[i].second_register);
+  int reg;
+  for(reg = 0; reg < 32; reg++)
+    if(used_registers & (1u << reg))
+      fprintf(file, "  int r%d = %s;\n", reg, reg == 6 ? "STACK_SIZE" : "0");
+  if(lazy)
+    fprintf(file, "  int compared_second = 1, compared_first = 0;\n");
+  fprintf(file, "  unsigned int program_counter;\n\n");
+
+  for(i = 0; i < num_instructions; i++)
+  {
+    instruction_t instr = instructions[i];
+    int first = instr.first_register;
+    int second = instr.second_register;
+    unsigned int target = i * 4 + instr.immediate + 4;
+
+    fprintf(file, " L%u: ", i * 4);
+    switch(instr.opcode)
+    {
+    case subl:
+      fprintf(file, "r%d = (int)((unsigned)r%d - (unsigned)%d);", first, first, instr.immediate);
+      break;
+    case addl_reg_reg:
+      fprintf(file, "r%d = (int)((unsigned)r%d + (unsigned)r%d);", second, first, second);
+      break;
+    case addl_imm_reg:
+      fprintf(file, "r%d = (int)((unsigned)r%d + (unsigned)%d);", first, first, instr.immediate);
+      break;
+    case imull:
+      fprintf(file, "r%d = (int)((unsigned)r%d * (unsigned)r%d);", second, first, second);
+      break;
+    case shrl:
+      fprintf(file, "r%d = (int)((unsigned)r%d >> 1);", first, first);
+      break;
+    case movl_reg_reg:
+      fprintf(file, "r%d = r%d;", second, first);
+      break;
+    case movl_deref_reg:
+      fprintf(file, "r%d = load(r%d + %d);", second, first, instr.immediate);
+      break;
+    case movl_reg_deref:
+      fprintf(file, "store(r%d + %d, r%d);", second, instr.immediate, first);
+      break;
+    case movl_imm_reg:
+      fprintf(file, "r%d = %d;", first, instr.immediate);
+      break;
+    case cmpl:
+      if(lazy)
+      {
+        fprintf(file, "compared_second = r%d; compared_first = r%d;", second, first);
+      }
+      else
+      {
+        // Each flag is set as soon as it is known, which matters when r16 is an operand
+        fprintf(file, "r16 = 0;\n");
+        fprintf(file, "  if((unsigned)r%d < (unsigned)r%d) r16 |= 0x1;\n", second, first);
+        fprintf(file, "  if((int)((unsigned)r%d - (unsigned)r%d) == 0) r16 |= 0x40;\n", second, first);
+        fprintf(file, "  if((int)((unsigned)r%d - (unsigned)r%d) < 0) r16 |= 0x80;\n", second, first);
+        fprintf(file, "  if((long)r%d - (long)r%d > 2147483647L || (long)r%d - (long)r%d < -2147483648L) r16 |= 0x800;",
+                second, first, second, first);
+      }
+      break;
+    case je: case jl: case jle: case jge: case jbe:
+      fprintf(file, "if(");
+      write_condition(file, instr.opcode, lazy);
+      fprintf(file, ") ");
+      write_jump(file, target, num_instructions);
+      break;
+    case jmp:
+      write_jump(file, target, num_instructions);
+      break;
+    case call:
+      fprintf(file, "r6 = (int)((unsigned)r6 - 4u); store(r6, %u); ", i * 4 + 4);
+      write_jump(file, target, num_instructions);
+      break;
+    case ret:
+      fprintf(file, "if(r6 == STACK_SIZE) return 0;\n");
+      fprintf(file, "  program_counter = load(r6); r6 = (int)((unsigned)r6 + 4u);\n");
+      fprintf(file, "  if(program_counter %% 4 != 0 || program_counter / 4 > %uu) bad_program_counter(program_counter);\n",
+              num_instructions);
+      fprintf(file, "  goto *labels[program_counter / 4];");
+      break;
+    case pushl:
+      fprintf(file, "r6 = (int)((unsigned)r6 - 4u); store(r6, r%d);", first);
+      break;
+    case popl:
+      fprintf(file, "r%d = load(r6); r6 = (int)((unsigned)r6 + 4u);", first);
+      break;
+    case printr:
+      fprintf(file, "printf(\"%%d (0x%%x)\\n\", r%d, r%d);", first, first);
+      break;
+    case readr:
+      fprintf(file, "r%d = read_register(r%d);", first, first);
+      break;
+    default:
+      fprintf(file, ";");//opcodes without an instruction do nothing
+      break;
+    }
+    fprintf(file, "\n");
+  }
+  fprintf(file, " L%u:\n  return 0;\n}\n", num_instructions * 4);
+
+  if(fclose(file) != 0)
+    error_exit("unable to write translation output file");
+}
+
+// Names of the opcodes, for reports
+static const char* opcode_names[32] = {
+  [subl] = "subl", [addl_reg_reg] = "addl_reg_reg", [addl_imm_reg] = "addl_imm_reg",
+  [imull] = "imull", [shrl] = "shrl", [movl_reg_reg] = "movl_reg_reg",
+  [movl_deref_reg] = "movl_deref_reg", [movl_reg_deref] = "movl_reg_deref",
+  [movl_imm_reg] = "movl_imm_reg", [cmpl] = "cmpl", [je] = "je", [jl] = "jl", [jle] = "jle",
+  [jge] = "jge", [jbe] = "jbe", [jmp] = "jmp", [call] = "call", [ret] = "ret",
+  [pushl] = "pushl", [popl] = "popl", [printr] = "printr", [readr] = "readr"
+};
+
+// Most lines in each table of a profile report
+#define PROFILE_LINES 32
+
+// Counts the comparison below sorts by, since qsort passes it no context
+static unsigned long* sort_counts;
+
+/*
+ * Orders instruction indices by descending count, then by index
+*/
+static int compare_counts(const void* a, const void* b)
+{
+  unsigned int first = *(const unsigned int*)a;
+  unsigned int second = *(const unsigned int*)b;
+  if(sort_counts[first] != sort_counts[second])
+    return sort_counts[first] < sort_counts[second] ? 1 : -1;
+  return first < second ? -1 : 1;
+}
+
+/*
+ * Returns the indices of the instructions with a nonzero count, sorted by count
+*/
+static unsigned int* sort_by_count(unsigned long* counts, unsigned int num_instructions, unsigned int* num_sorted)
+{
+  unsigned int* sorted = (unsigned int*)malloc((num_instructions + 1) * sizeof(unsigned int));
+  if(sorted == NULL)
+    error_exit("unable to allocate memory for the profile");
+  unsigned int i;
+  *num_sorted = 0;
+  for(i = 0; i < num_instructions; i++)
+  {
+    if(counts[i] != 0)
+      sorted[(*num_sorted)++] = i;
+  }
+  sort_counts = counts;
+  qsort(sorted, *num_sorted, sizeof(unsigned int), compare_counts);
+  return sorted;
+}
+
+/*
+ * Writes the report of a profiled run to its file: instructions per second, then
+ * the hottest instructions, conditional jumps and call targets
+*/
+void write_profile(profile* prof, instruction_t* instructions, unsigned int num_instructions)
+{
+  struct timespec stop;
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  double seconds = (stop.tv_sec - prof->start.tv_sec) + (stop.tv_nsec - prof->start.tv_nsec) / 1e9;
+
+  FILE* file = fopen(prof->file, "w");
+  if(file == NULL)
+    error_exit("unable to open profile report file");
+
+  // Each instruction ran as often as its block, or the part of it it is in, was entered
+  unsigned long* counts = (unsigned long*)malloc((num_instructions + 1) * sizeof(unsigned long));
+  unsigned char* leaders = find_block_leaders(instructions, num_instructions);
+  if(counts == NULL)
+    error_exit("unable to allocate memory for the profile");
+  unsigned long total = 0;
+  unsigned int i;
+  for(i = 0; i < num_instructions; i++)
+  {
+    counts[i] = leaders[i] ? prof->entries[i] : counts[i - 1] + prof->entries[i];
+    total += counts[i];
+  }
+  free(leaders);
+  fprintf(file, "instructions: %lu in %.6f s, %.0f instructions/s\n",
+          total, seconds, seconds > 0 ? total / seconds : 0.0);
+
+  unsigned int num_sorted;
+  unsigned int* sorted = sort_by_count(counts, num_instructions, &num_sorted);
+  fprintf(file, "\nhot spots:\n%8s %14s %7s  %s\n", "pc", "executed", "share", "instruction");
+  for(i = 0; i < num_sorted && i < PROFILE_LINES; i++)
+  {
+    instruction_t instr = instructions[sorted[i]];
+    fprintf(file, "%8u %14lu %6.2f%%  %s %d %d %d\n", sorted[i] * 4, counts[sorted[i]],
+            100.0 * counts[sorted[i]] / total, opcode_names[instr.opcode & 0x1F] ? opcode_names[instr.opcode & 0x1F] : "nop",
+            instr.first_register, instr.second_register, instr.immediate);
+  }
+
+  // Conditional jumps keep their place in the order of all instructions
+  fprintf(file, "\nbranches:\n%8s %14s %14s %14s\n", "pc", "executed", "taken", "not taken");
+  unsigned int lines = 0;
+  for(i = 0; i < num_sorted && lines < PROFILE_LINES; i++)
+  {
+    unsigned int index = sorted[i];
+    if(instructions[index].opcode >= je && instructions[index].opcode <= jbe)
+    {
+      fprintf(file, "%8u %14lu %14lu %14lu\n", index * 4, counts[index],
+              prof->taken[index], counts[index] - prof->taken[index]);
+      lines++;
+    }
+  }
+  free(sorted);
+
+  sorted = sort_by_count(prof->calls, num_instructions, &num_sorted);
+  fprintf(file, "\ncall targets:\n%8s %14s\n", "pc", "calls");
+  for(i = 0; i < num_sorted && i < PROFILE_LINES; i++)
+    fprintf(file, "%8u %14lu\n", sorted[i] * 4, prof->calls[sorted[i]]);
+  free(sorted);
+  free(counts);
+
+  fclose(file);
+}
+
+/*
+ * Sets up the caches a spec describes. Levels are separated by commas, and each
+ * is size:ways:line size, optionally followed by :lru or :plru. Sizes are in
+ * bytes, and the line size and number of sets must be powers of two.
+*/
+void create_cache(cache_model* cache, const char* spec)
+{
+  memset(cache, 0, sizeof(cache_model));
+  while(*spec != '\0')
+  {
+    if(cache->num_levels == MAX_CACHE_LEVELS)
+      error_exit("too many cache levels");
+    cache_level* c = &cache->levels[cache->num_levels++];
+    char* end;
+    c->size = strtoul(spec, &end, 0);
+    if(*end == ':')
+      c->ways = strtoul(end + 1, &end, 0);
+    if(*end == ':')
+      c->line_size = strtoul(end + 1, &end, 0);
+    if(strncmp(end, ":plru", 5) == 0)
+    {
+      c->plru = 1;
+      end += 5;
+    }
+    else if(strncmp(end, ":lru", 4) == 0)
+      end += 4;
+    if(*end != ',' && *end != '\0')
+      error_exit("invalid cache level, expected size:ways:line size[:lru|plru]");
+    spec = (*end == ',') ? end + 1 : end;
+
+    if(c->ways == 0 || c->line_size < 4 || (c->line_size & (c->line_size - 1)) != 0
+       || c->size % (c->ways * c->line_size) != 0 || c->size == 0)
+      error_exit("invalid cache level, the size must be a multiple of ways times a power of two line size");
+    c->num_sets = c->size / (c->ways * c->line_size);
+    if((c->num_sets & (c->num_sets - 1)) != 0)
+      error_exit("invalid cache level, the number of sets must be a power of two");
+    if(c->plru && (c->ways > 32 || (c->ways & (c->ways - 1)) != 0))
+      error_exit("invalid cache level, pseudo-LRU needs a power of two ways up to 32");
+    while((1u << c->line_shift) < c->line_size)
+      c->line_shift++;
+
+    c->tags = (unsigned int*)calloc(c->num_sets * c->ways, sizeof(unsigned int));
+    if(c->plru)
+      c->tree = (unsigned int*)calloc(c->num_sets, sizeof(unsigned int));
+    else
+      c->used = (unsigned long*)calloc(c->num_sets * c->ways, sizeof(unsigned long));
+    if(c->tags == NULL || (c->tree == NULL && c->used == NULL))
+      error_exit("unable to allocate memory for the cache model");
+  }
+  if(cache->num_levels == 0)
+    error_exit("invalid cache level, expected size:ways:line size[:lru|plru]");
+}
+
+/*
+ * Marks a way of a set as the most recently used
+ *  Pseudo-LRU points every tree node on the way's path at the other half
+*/
+static void touch_way(cache_level* c, unsigned int set, unsigned int way)
+{
+  if(!c->plru)
+  {
+    c->used[set * c->ways + way] = ++c->clock;
+    return;
+  }
+  unsigned int node = 1;
+  unsigned int half;
+  for(half = c->ways / 2; half > 0; half /= 2)
+  {
+    unsigned int right = (way & half) != 0;
+    if(right)
+      c->tree[set] &= ~(1u << node);
+    else
+      c->tree[set] |= 1u << node;
+    node = node * 2 + right;
+  }
+}
+
+/*
+ * Picks the way of a full set to replace
+*/
+static unsigned int victim_way(cache_level* c, unsigned int set)
+{
+  unsigned int way = 0;
+  if(!c->plru)
+  {
+    unsigned long* used = c->used + set * c->ways;
+    unsigned int i;
+    for(i = 1; i < c->ways; i++)
+    {
+      if(used[i] < used[way])
+        way = i;
+    }
+    return way;
+  }
+  unsigned int node = 1;
+  unsigned int half;
+  for(half = c->ways / 2; half > 0; half /= 2)
+  {
+    unsigned int right = (c->tree[set] >> node) & 1;
+    way |= right ? half : 0;
+    node = node * 2 + right;
+  }
+  return way;
+}
+
+/*
+ * Looks up the line holding an address at one level, and on a miss brings it in
+ * there after looking it up at the next level
+*/
+static void cache_reference(cache_model* cache, int level, unsigned int address)
+{
+  cache_level* c = &cache->levels[level];
+  unsigned int line = address >> c->line_shift;
+  unsigned int set = line & (c->num_sets - 1);
+  unsigned int* tags = c->tags + set * c->ways;
+  unsigned int way;
+
+  for(way = 0; way < c->ways; way++)
+  {
+    if(tags[way] == line + 1)
+    {
+      c->hits++;
+      touch_way(c, set, way);
+      return;
+    }
+  }
+  c->misses++;
+  for(way = 0; way < c->ways && tags[way] != 0; way++)
+    ;
+  if(way == c->ways)
+  {
+    way = victim_way(c, set);
+    c->evictions++;
+  }
+  tags[way] = line + 1;
+  touch_way(c, set, way);
+  if(level + 1 < cache->num_levels)
+    cache_reference(cache, level + 1, address);
+}
+
+/*
+ * Models a 4 byte read or write of the simulated memory. Writes allocate lines
+ * like reads, and an access that straddles two lines of the first level
+ * references both.
+*/
+void cache_access(cache_model* cache, unsigned int address, int write)
+{
+  unsigned int shift = cache->levels[0].line_shift;
+  if(write)
+    cache->writes++;
+  else
+    cache->reads++;
+  cache_reference(cache, 0, address);
+  if((address >> shift) != ((address + 3) >> shift))
+    cache_reference(cache, 0, address + 3);
+}
+
+/*
+ * Prints the accesses, hits, misses and evictions of each cache level to stderr,
+ * so they stay apart from the program's output
+*/
+void write_cache_report(cache_model* cache)
+{
+  int level;
+  fprintf(stderr, "cache model: %lu accesses, %lu reads, %lu writes\n",
+          cache->reads + cache->writes, cache->reads, cache->writes);
+  for(level = 0; level < cache->num_levels; level++)
+  {
+    cache_level* c = &cache->levels[level];
+    unsigned long references = c->hits + c->misses;
+    fprintf(stderr, "L%d %u bytes, %u-way, %u byte lines, %s: %lu references, %lu hits, %lu misses (%.2f%%), %lu evictions\n",
+            level + 1, c->size, c->ways, c->line_size, c->plru ? "PLRU" : "LRU", references, c->hits, c->misses,
+            references > 0 ? 100.0 * c->misses / references : 0.0, c->evictions);
+  }
+}
+
+// Bytes of memory a checkpoint stores or skips at a time, so untouched memory costs nothing
+#define CHECKPOINT_PAGE 4096
+// A checkpoint starts with this magic
+#define CHECKPOINT_MAGIC "SIMCKPT1"
+
+/*
+ * Everything about a run a checkpoint stores besides memory. Memory follows as
+ * the index of every page that is not all zeros and its bytes, then an index
+ * of 0xFFFFFFFF.
+*/
+typedef struct checkpoint_header
+{
+  char magic[8];
+  unsigned int program_counter;
+  unsigned int num_instructions;//of the program it was taken from
+  unsigned int memory_size;
+  unsigned int stack_top;
+  int registers[NUM_REGS];
+  int input_failed;
+  unsigned long input_position;//bytes of the input readr had read
+} checkpoint_header;
+
+static void request_checkpoint(int signal_number)
+{
+  (void)signal_number;
+  checkpoint_requested = 1;
+}
+
+/*
+ * Makes SIGUSR1 ask for a checkpoint instead of ending the simulator
+*/
+void catch_checkpoint_signal(void)
+{
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_checkpoint;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if(sigaction(SIGUSR1, &action, NULL) != 0)
+    error_exit("unable to catch SIGUSR1 for checkpoints");
+}
+
+/*
+ * Writes the state of a run, about to execute program_counter, to the checkpoint
+ * file. The output so far is flushed first, so a run resumed from the checkpoint
+ * goes on right after it. The checkpoint goes to a temporary file that then
+ * replaces the last one, so there is always a whole checkpoint to resume from.
+*/
+void write_checkpoint(checkpoint* snap, machine* m, unsigned int program_counter, unsigned int num_instructions)
+{
+  flush_output(&m->output);
+  fflush(m->output.file);
+
+  size_t name_length = strlen(snap->file);
+  char* temporary = (char*)malloc(name_length + 5);
+  if(temporary == NULL)
+    error_exit("unable to allocate memory for the checkpoint");
+  memcpy(temporary, snap->file, name_length);
+  memcpy(temporary + name_length, ".tmp", 5);
+  FILE* file = fopen(temporary, "wb");
+  if(file == NULL)
+    error_exit("unable to open checkpoint file");
+
+  checkpoint_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CHECKPOINT_MAGIC, 8);
+  header.program_counter = program_counter;
+  header.num_instructions = num_instructions;
+  header.memory_size = m->memory_size;
+  header.stack_top = m->stack_top;
+  memcpy(header.registers, m->registers, sizeof(int) * NUM_REGS);
+  header.input_failed = m->input.failed;
+  header.input_position = m->input.offset + m->input.next;
+  fwrite(&header, sizeof(header), 1, file);
+
+  static const unsigned char zeros[CHECKPOINT_PAGE];
+  unsigned int page;
+  for(page = 0; (size_t)page * CHECKPOINT_PAGE < m->memory_size; page++)
+  {
+    size_t start = (size_t)page * CHECKPOINT_PAGE;
+    size_t size = (m->memory_size - start < CHECKPOINT_PAGE) ? m->memory_size - start : CHECKPOINT_PAGE;
+    if(memcmp(m->memory + start, zeros, size) == 0)
+      continue;
+    fwrite(&page, sizeof(page), 1, file);
+    fwrite(m->memory + start, 1, size, file);
+  }
+  page = 0xFFFFFFFF;
+  fwrite(&page, sizeof(page), 1, file);
+
+  if(fclose(file) != 0 || rename(temporary, snap->file) != 0)
+    error_exit("unable to write checkpoint file");
+  free(temporary);
+}
+
+/*
+ * Skips the part of the input a checkpointed run had already read
+ * Returns 0 when the input is shorter than that
+*/
+static int skip_input(input_stream* in, unsigned long position)
+{
+  if(in->fd == -1)
+  {
+    if(position > in->end)
+      return 0;
+    in->next = position;
+    return 1;
+  }
+  // A regular file seeks from where the run started reading it, as long as the
+  // position is not past its end, where lseek would still succeed
+  struct stat status;
+  off_t start = lseek(in->fd, 0, SEEK_CUR);
+  if(start != -1 && fstat(in->fd, &status) == 0 && S_ISREG(status.st_mode))
+  {
+    if(status.st_size < start || (unsigned long)(status.st_size - start) < position)
+      return 0;
+    if(lseek(in->fd, start + position, SEEK_SET) != -1)
+    {
+      in->offset = position;
+      return 1;
+    }
+  }
+  // Pipes and terminals cannot seek, so read up to the position
+  while(in->offset + in->end < position)
+  {
+    in->offset += in->end;
+    ssize_t num_read = read(in->fd, in->buffer, INPUT_CHUNK);
+    if(num_read <= 0)
+      return 0;
+    in->end = num_read;
+  }
+  in->next = position - in->offset;
+  return 1;
+}
+
+/*
+ * Sets up a machine from a checkpoint of a run of this program: its memory,
+ * registers, program counter and place in the input, which must be open
+*/
+void restore_checkpoint(machine* m, const char* file_name, unsigned int num_instructions)
+{
+  FILE* file = fopen(file_name, "rb");
+  if(file == NULL)
+    error_exit("unable to open checkpoint file");
+  checkpoint_header header;
+  if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, 8) != 0)
+    error_exit("invalid checkpoint file");
+  if(header.num_instructions != num_instructions)
+    error_exit("checkpoint was taken from another program");
+  if(header.program_counter % 4 != 0 || header.program_counter / 4 > num_instructions
+     || header.stack_top > header.memory_size || header.memory_size > 2u * MAX_STACK_SIZE)
+    error_exit("invalid checkpoint file");
+
+  // The whole memory is made like a stack, then the stack top is put back
+  const char* error;
+  if(!create_memory(m, header.memory_size, NULL, &error))
+    error_exit(error);
+  m->stack_top = header.stack_top;
+  m->program_counter = header.program_counter;
+  memcpy(m->registers, header.registers, sizeof(int) * NUM_REGS);
+
+  unsigned int page;
+  while(fread(&page, sizeof(page), 1, file) == 1 && page != 0xFFFFFFFF)
+  {
+    size_t start = (size_t)page * CHECKPOINT_PAGE;
+    if(start >= m->memory_size)
+      error_exit("invalid checkpoint file");
+    size_t size = (m->memory_size - start < CHECKPOINT_PAGE) ? m->memory_size - start : CHECKPOINT_PAGE;
+    if(fread(m->memory + start, 1, size, file) != size)
+      error_exit("invalid checkpoint file");
+  }
+  if(page != 0xFFFFFFFF)
+    error_exit("invalid checkpoint file");
+  fclose(file);
+
+  if(!skip_input(&m->input, header.input_position))
+    error_exit("program input is shorter than at the checkpoint");
+  m->input.failed = header.input_failed;
+}
+
+/*
+ * One program of a batch, and the output of its run
+*/
+typedef struct batch_job
+{
+  char* binary;
+  char* input;//file readr reads from, or NULL for no input
+  char* output;
+  size_t output_size;
+} batch_job;
+
+/*
+ * Programs of a batch, shared by the worker threads
+*/
+typedef struct batch
+{
+  batch_job* jobs;
+  unsigned int num_jobs;
+  unsigned int next_job;//taken with an atomic add by the workers
+  int engine;
+  unsigned int stack_size;
+  const char* data_file;
+} batch;
+
+/*
+ * Loads and runs one program of a batch with its own registers and memory,
+ * collecting its output in memory. Problems with its files, or no memory for its
+ * machine, go to its output instead of ending the whole batch.
+*/
+static void run_job(batch_job* job, batch* work)
+{
+  FILE* output = open_memstream(&job->output, &job->output_size);
+  if(output == NULL)
+    return;//run_batch reports a job without output
+
+  unsigned int num_instructions;
+  const char* error;
+  instruction_t* instructions = map_program(job->binary, &num_instructions, &error);
+  machine m;
+  if(instructions == NULL)
+  {
+    fprintf(output, "Error: %s\n", error);
+    fclose(output);
+    return;
+  }
+  if(!map_input(&m.input, job->input))
+  {
+    fprintf(output, "Error: unable to open program input\n");
+    free(instructions);
+    fclose(output);
+    return;
+  }
+  if(!create_memory(&m, work->stack_size, work->data_file, &error))
+  {
+    fprintf(output, "Error: %s\n", error);
+    close_input(&m.input);
+    free(instructions);
+    fclose(output);
+    return;
+  }
+  if(!open_output(&m.output, output))
+  {
+    fprintf(output, "Error: unable to allocate memory for program output\n");
+    destroy_memory(&m);
+    close_input(&m.input);
+    free(instructions);
+    fclose(output);
+    return;
+  }
+
+  run_program(work->engine, instructions, num_instructions, &m, NULL, NULL, NULL);
+
+  close_output(&m.output);
+  close_input(&m.input);
+  fclose(output);
+  destroy_memory(&m);
+  free(instructions);
+}
+
+/*
+ * Worker thread of a batch: runs programs until none are left
+*/
+static void* batch_worker(void* argument)
+{
+  batch* work = (batch*)argument;
+  unsigned int job;
+
+  while((job = __atomic_fetch_add(&work->next_job, 1, __ATOMIC_RELAXED)) < work->num_jobs)
+    run_job(&work->jobs[job], work);
+  return NULL;
+}
+
+/*
+ * Runs every program listed in a file on a pool of threads. Each line of the list
+ * names a binary, optionally followed by a file its readr instructions read from.
+ * When all have run, their outputs are printed in the order of the list, each
+ * after a line with the name of its binary.
+*/
+void run_batch(const char* list_file, int engine, int num_threads, unsigned int stack_size, const char* data_file)
+{
+  FILE* list = fopen(list_file, "r");
+  if(list == NULL)
+    error_exit("unable to open batch list");
+
+  batch work = {NULL, 0, 0, engine, stack_size, data_file};
+  unsigned int capacity = 0;
+  char line[4096];
+  while(fgets(line, sizeof(line), list) != NULL)
+  {
+    char* binary = strtok(line, " \t\r\n");
+    char* input = strtok(NULL, " \t\r\n");
+    if(binary == NULL)
+      continue;//blank line
+    if(work.num_jobs == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 64;
+      work.jobs = (batch_job*)realloc(work.jobs, capacity * sizeof(batch_job));
+      if(work.jobs == NULL)
+        error_exit("unable to allocate memory for the batch");
+    }
+    batch_job* job = &work.jobs[work.num_jobs++];
+    job->binary = strdup(binary);
+    job->input = (input != NULL) ? strdup(input) : NULL;
+    job->output = NULL;
+    job->output_size = 0;
+  }
+  fclose(list);
+
+  if(num_threads > (int)work.num_jobs)
+    num_threads = work.num_jobs;
+  pthread_t* threads = (pthread_t*)malloc((num_threads + 1) * sizeof(pthread_t));
+  if(threads == NULL)
+    error_exit("unable to allocate memory for the batch");
+  int i;
+  for(i = 0; i < num_threads; i++)
+  {
+    if(pthread_create(&threads[i], NULL, batch_worker, &work) != 0)
+      error_exit("unable to start batch threads");
+  }
+  for(i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  unsigned int job;
+  for(job = 0; job < work.num_jobs; job++)
+  {
+    printf("==> %s <==\n", work.jobs[job].binary);
+    if(work.jobs[job].output == NULL)
+      printf("Error: unable to allocate memory for program output\n");
+    fwrite(work.jobs[job].output, 1, work.jobs[job].output_size, stdout);
+    free(work.jobs[job].binary);
+    free(work.jobs[job].input);
+    free(work.jobs[job].output);
+  }
+  free(work.jobs);
+}
+
 
 /*********************************************/
 /****  DO NOT MODIFY THE FUNCTIONS BELOW  ****/
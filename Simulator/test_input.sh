@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Checks that readr reads the last number of an input that ends without white
+# space, from a pipe and from a file given with -i, also when the number
+# crosses a chunk of the input buffer.
+#
+# Usage: ./test_input.sh [simulator binary, ./simulator by default]
+
+SIM=${1:-./simulator}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+status=0
+
+# readr 0; printr 0; readr 0; printr 0
+printf '\000\000\000\250\000\000\000\240\000\000\000\250\000\000\000\240' > "$DIR/read.bin"
+
+# run_test <name> <expected output> <input file>
+run_test()
+{
+  for mode in pipe file; do
+    if [ $mode = pipe ]; then
+      output=$("$SIM" "$DIR/read.bin" < "$3")
+    else
+      output=$("$SIM" -i "$3" "$DIR/read.bin")
+    fi
+    if [ "$output" != "$2" ]; then
+      echo "FAIL $1 ($mode): printed '$output', expected '$2'"
+      status=1
+    else
+      echo "PASS $1 ($mode)"
+    fi
+  done
+}
+
+printf '5 100' > "$DIR/no_newline.txt"
+run_test no_newline "5 (0x5)
+100 (0x64)" "$DIR/no_newline.txt"
+
+# 65536 bytes is one chunk, so 123456 starts in the first and ends in the second
+head -c 65533 /dev/zero | tr '\0' ' ' > "$DIR/chunk.txt"
+printf '1 123456' >> "$DIR/chunk.txt"
+run_test chunk_boundary "1 (0x1)
+123456 (0x1e240)" "$DIR/chunk.txt"
+
+# 123456 ends the first chunk and the input, so the next read finds nothing
+head -c 65528 /dev/zero | tr '\0' ' ' > "$DIR/chunk_end.txt"
+printf '1 123456' >> "$DIR/chunk_end.txt"
+run_test chunk_end "1 (0x1)
+123456 (0x1e240)" "$DIR/chunk_end.txt"
+
+exit $status
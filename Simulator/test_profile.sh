@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Checks that -p writes its report however a program stops: running past its
+# last instruction, or at ret from the top frame, and that a conditional jump to
+# the instruction after it counts as taken when it branches.
+#
+# Usage: ./test_profile.sh [simulator binary, ./simulator by default]
+
+SIM=${1:-./simulator}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+status=0
+
+# run_test <name> <expected output> <program bytes>
+run_test()
+{
+  printf "$3" > "$DIR/$1.bin"
+  output=$("$SIM" -p "$DIR/$1.txt" "$DIR/$1.bin")
+  if [ "$output" != "$2" ]; then
+    echo "FAIL $1: printed '$output', expected '$2'"
+    status=1
+  elif ! grep -q "^instructions: " "$DIR/$1.txt" 2>/dev/null; then
+    echo "FAIL $1: no profile report"
+    status=1
+  else
+    echo "PASS $1"
+  fi
+}
+
+# movl_imm_reg 0 0 5; printr 0
+run_test past_end "5 (0x5)" '\005\000\000\100\000\000\000\240'
+# movl_imm_reg 0 0 7; printr 0; ret
+run_test ret_halt "7 (0x7)" '\007\000\000\100\000\000\000\240\000\000\000\210'
+
+# movl_imm_reg 0 0 1; cmpl 0 0; je 0; cmpl 0 1; je 0; printr 0
+run_test branch_next "1 (0x1)" '\001\000\000\100\000\000\000\110\000\000\000\120\000\000\002\110\000\000\000\120\000\000\000\240'
+# pc, executed, taken, not taken
+for branch in "8 1 1 0" "16 1 0 1"; do
+  if ! sed -n '/^branches:/,/^call targets:/p' "$DIR/branch_next.txt" | tr -s ' ' | grep -q "^ $branch\$"; then
+    echo "FAIL branch_next: no branch '$branch' in the report"
+    status=1
+  fi
+done
+
+exit $status